@@ -0,0 +1,421 @@
+#include "audioconverter.h"
+#include <QThread>
+#include <QEventLoop>
+#include <string.h>
+
+AudioConverter::AudioConverter(QObject *parent) :
+  QObject(parent)
+{
+  m_converting = false;
+  m_succeeded = false;
+  m_abort = NULL;
+  m_sampleRate = 0;
+  m_stream = NULL;
+  m_file = NULL;
+  m_hash = CONTENT_HASH_INIT;
+  m_isWav = false;
+  m_decoderFinished = false;
+  m_resamplerReady = false;
+  m_waiting = false;
+  m_inputEnded = false;
+  m_inputFrames = 0;
+
+  // types crossing threads in queued calls
+  qRegisterMetaType<StreamChunkSource*>("StreamChunkSource*");
+  qRegisterMetaType<QFile*>("QFile*");
+
+  // a child, so it moves to the converter thread along with it
+  m_decoder = new QAudioDecoder(this);
+  connect(m_decoder, SIGNAL(bufferReady()), this, SLOT(processDecodedBuffers()));
+  connect(m_decoder, SIGNAL(finished()), this, SLOT(handleDecoderFinished()));
+  connect(m_decoder, SIGNAL(error(QAudioDecoder::Error)), this, SLOT(handleDecoderError(QAudioDecoder::Error)));
+}
+
+void AudioConverter::convertToStream(QString source, int sampleRate, StreamChunkSource* output)
+{
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "convertToStream", Qt::QueuedConnection, Q_ARG(QString, source),
+                              Q_ARG(int, sampleRate), Q_ARG(StreamChunkSource*, output));
+    return;
+  }
+
+  finish(false); // the previous one, if any
+  m_stream = output;
+  // released on the client thread as the device answers
+  connect(m_stream, SIGNAL(spaceFreed()), this, SLOT(resume()));
+  start(source, sampleRate);
+}
+
+void AudioConverter::convertToFile(QString source, int sampleRate, QFile* output)
+{
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "convertToFile", Qt::QueuedConnection, Q_ARG(QString, source),
+                              Q_ARG(int, sampleRate), Q_ARG(QFile*, output));
+    return;
+  }
+
+  finish(false);
+  m_file = output;
+  m_hash = CONTENT_HASH_INIT;
+  start(source, sampleRate);
+}
+
+void AudioConverter::cancel()
+{
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "cancel", Qt::QueuedConnection);
+    return;
+  }
+
+  finish(false);
+}
+
+bool AudioConverter::convert(QString source, int sampleRate, QFile* output, const QAtomicInt* abort)
+{
+  QEventLoop loop;
+
+  m_abort = abort;
+  connect(this, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+  convertToFile(source, sampleRate, output);
+  if(m_converting)
+    loop.exec();
+  m_abort = NULL;
+  return m_succeeded;
+}
+
+quint64 AudioConverter::contentHash() const
+{
+  return m_hash;
+}
+
+void AudioConverter::start(QString source, int sampleRate)
+{
+  m_converting = true;
+  m_sampleRate = sampleRate;
+  m_decoderFinished = false;
+  m_resamplerReady = false;
+  m_waiting = false;
+  m_inputEnded = false;
+  m_inputFrames = 0;
+  m_pending.clear();
+  m_clock.start();
+
+  m_isWav = m_wav.open(source);
+  if(m_isWav)
+  {
+    emit log(QString("WAV: %1 Hz, %2 channels.").arg(m_wav.sampleRate()).arg(m_wav.channels()));
+    m_resampler.configure(m_wav.sampleRate(), m_sampleRate);
+    m_resamplerReady = true;
+    m_frames.resize(BLOCK_FRAMES * m_wav.channels());
+    QMetaObject::invokeMethod(this, "processWav", Qt::QueuedConnection);
+  }
+  else
+  {
+    // not one WavDecoder reads, maybe the platform decoder does
+    m_decoder->setSourceFilename(source);
+    m_decoder->start();
+  }
+}
+
+/*
+ * a slice of the WAV file at a time, then it queues itself again
+*/
+void AudioConverter::processWav()
+{
+  if(!m_converting || !m_isWav || m_inputEnded)
+    return;
+
+  for(int i = 0; i < BLOCKS_PER_SLICE; i++)
+  {
+    if(isAborted())
+      return;
+    if(!flushPending())
+      return; // resume() goes on once there is room
+
+    qint64 count = m_wav.read(m_frames.data(), BLOCK_FRAMES);
+    if(count < 0)
+    {
+      emit log(QString("Could not read the audio file: %1").arg(m_wav.errorString()));
+      finish(false);
+      return;
+    }
+    if(count == 0)
+    {
+      endOfInput();
+      return;
+    }
+    convertFrames(m_frames.constData(), count, m_wav.channels());
+    if(!m_converting)
+      return;
+  }
+
+  QMetaObject::invokeMethod(this, "processWav", Qt::QueuedConnection);
+}
+
+/*
+ * buffers not read stay in the decoder, which stops decoding when it has a few:
+ * that is how a full stream holds it back
+*/
+void AudioConverter::processDecodedBuffers()
+{
+  if(!m_converting || m_isWav || m_inputEnded)
+    return;
+
+  while(m_decoder->bufferAvailable())
+  {
+    if(isAborted())
+      return;
+    if(!flushPending())
+      return;
+
+    QAudioBuffer buffer = m_decoder->read();
+    if(!buffer.isValid())
+      break;
+
+    if(!m_resamplerReady)
+    {
+      emit log(QString("Decoded: %1 Hz, %2 channels.").arg(buffer.format().sampleRate())
+               .arg(buffer.format().channelCount()));
+      m_resampler.configure(buffer.format().sampleRate(), m_sampleRate);
+      m_resamplerReady = true;
+    }
+
+    if(!fromAudioBuffer(buffer, m_frames))
+    {
+      emit log(QString("Unsupported decoded sample format."));
+      finish(false);
+      return;
+    }
+    convertFrames(m_frames.constData(), buffer.frameCount(), buffer.format().channelCount());
+    if(!m_converting)
+      return;
+  }
+
+  if(m_decoderFinished && !m_decoder->bufferAvailable())
+    endOfInput();
+}
+
+void AudioConverter::handleDecoderFinished()
+{
+  if(!m_converting)
+    return;
+
+  if(!m_resamplerReady)
+  {
+    emit log(QString("The file has no audio."));
+    finish(false);
+    return;
+  }
+
+  m_decoderFinished = true;
+  processDecodedBuffers();
+}
+
+void AudioConverter::handleDecoderError(QAudioDecoder::Error error)
+{
+  if(!m_converting)
+    return;
+
+  emit log(QString("Could not decode the audio file (%1): %2").arg(error).arg(m_decoder->errorString()));
+  finish(false);
+}
+
+/*
+ * the stream freed some space
+*/
+void AudioConverter::resume()
+{
+  if(!m_converting || !m_waiting || !flushPending())
+    return;
+
+  if(m_inputEnded)
+    finish(true);
+  else if(m_isWav)
+    processWav();
+  else
+    processDecodedBuffers();
+}
+
+/*
+ * averages the channels into one, resamples it and writes it out
+*/
+void AudioConverter::convertFrames(const float* frames, int count, int channels)
+{
+  m_inputFrames += count;
+  m_mono.resize(count);
+
+  if(channels == 1)
+    memcpy(m_mono.data(), frames, count * sizeof(float));
+  else
+  {
+    float scale = 1.0f / channels;
+    for(int i = 0; i < count; i++)
+    {
+      float sum = 0;
+      for(int c = 0; c < channels; c++)
+        sum += frames[i * channels + c];
+      m_mono[i] = sum * scale;
+    }
+  }
+
+  m_resampled.resize(0);
+  m_resampler.process(m_mono.constData(), count, m_resampled);
+  writeSamples(m_resampled);
+}
+
+/*
+ * pcm_u8: 128 is silence
+*/
+void AudioConverter::writeSamples(const QVector<float>& samples)
+{
+  int count = samples.size();
+  const float* sample = samples.constData();
+
+  m_output.resize(count);
+  uchar* output = (uchar*) m_output.data();
+  for(int i = 0; i < count; i++)
+    output[i] = (uchar) qBound(0, qRound(sample[i] * 128.0f) + 128, 255);
+
+  if(m_file != NULL)
+  {
+    if(m_file->write(m_output) != count)
+    {
+      emit log(QString("Could not write the converted audio: %1").arg(m_file->errorString()));
+      finish(false);
+      return;
+    }
+    // while it is at hand, so the upload does not read it all again
+    m_hash = contentHashUpdate(m_hash, (const uint8_t*) m_output.constData(), count);
+    return;
+  }
+
+  // only called with nothing pending, so the order is kept
+  qint64 taken = m_stream->write(m_output.constData(), count);
+  if(taken < count)
+    m_pending.append(m_output.constData() + taken, count - taken);
+}
+
+/*
+ * true when nothing is left waiting for room in the stream
+*/
+bool AudioConverter::flushPending()
+{
+  if(m_pending.isEmpty())
+    return true;
+
+  if(m_stream->isAborted())
+  {
+    finish(false);
+    return false;
+  }
+
+  m_pending.remove(0, m_stream->write(m_pending.constData(), m_pending.size()));
+  m_waiting = !m_pending.isEmpty();
+  return !m_waiting;
+}
+
+void AudioConverter::endOfInput()
+{
+  m_inputEnded = true;
+  m_resampled.resize(0);
+  m_resampler.flush(m_resampled);
+  writeSamples(m_resampled);
+
+  if(m_converting && flushPending())
+    finish(true);
+}
+
+/*
+ * checked between blocks, so a convert() call stops within one of them
+*/
+bool AudioConverter::isAborted()
+{
+  if(m_abort == NULL || m_abort->load() == 0)
+    return false;
+
+  finish(false);
+  return true;
+}
+
+void AudioConverter::finish(bool success)
+{
+  if(!m_converting)
+    return;
+
+  m_converting = false;
+  m_succeeded = success;
+  m_waiting = false;
+  m_wav.close();
+  if(m_decoder->state() != QAudioDecoder::StoppedState)
+    m_decoder->stop();
+
+  if(success)
+    emit log(QString("Converted %1 s of audio in %2 ms.")
+             .arg(m_inputFrames / (double) m_resampler.inputRate(), 0, 'f', 1).arg(m_clock.elapsed()));
+
+  if(m_stream != NULL)
+  {
+    disconnect(m_stream, 0, this, 0);
+    if(success)
+      m_stream->finish();
+    else
+      m_stream->abort();
+    m_stream = NULL;
+  }
+
+  if(m_file != NULL)
+  {
+    if(success)
+      m_file->flush();
+    m_file = NULL;
+  }
+
+  m_pending.clear();
+  emit finished(success);
+}
+
+/*
+ * interleaved float samples from whatever the decoder gives
+*/
+bool AudioConverter::fromAudioBuffer(const QAudioBuffer& buffer, QVector<float>& frames)
+{
+  QAudioFormat format = buffer.format();
+  int count = buffer.sampleCount();
+
+  frames.resize(count);
+  float* output = frames.data();
+
+  if(format.sampleType() == QAudioFormat::Float && format.sampleSize() == 32)
+    memcpy(output, buffer.constData(), count * sizeof(float));
+  else if(format.sampleType() == QAudioFormat::SignedInt && format.sampleSize() == 16)
+  {
+    const qint16* input = (const qint16*) buffer.constData();
+    for(int i = 0; i < count; i++)
+      output[i] = input[i] * (1.0f / 32768);
+  }
+  else if(format.sampleType() == QAudioFormat::SignedInt && format.sampleSize() == 32)
+  {
+    const qint32* input = (const qint32*) buffer.constData();
+    for(int i = 0; i < count; i++)
+      output[i] = input[i] * (1.0f / 2147483648.0f);
+  }
+  else if(format.sampleType() == QAudioFormat::UnSignedInt && format.sampleSize() == 8)
+  {
+    const quint8* input = (const quint8*) buffer.constData();
+    for(int i = 0; i < count; i++)
+      output[i] = (input[i] - 128) * (1.0f / 128);
+  }
+  else if(format.sampleType() == QAudioFormat::SignedInt && format.sampleSize() == 8)
+  {
+    const qint8* input = (const qint8*) buffer.constData();
+    for(int i = 0; i < count; i++)
+      output[i] = input[i] * (1.0f / 128);
+  }
+  else
+    return false;
+
+  return true;
+}
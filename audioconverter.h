@@ -0,0 +1,118 @@
+#ifndef AUDIOCONVERTER_H
+#define AUDIOCONVERTER_H
+
+#include <QObject>
+#include <QFile>
+#include <QString>
+#include <QVector>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QAudioDecoder>
+#include <QAudioBuffer>
+#include "streamchunksource.h"
+#include "wavdecoder.h"
+#include "resampler.h"
+
+/*
+ * Converts an audio file to what the device plays: mono pcm_u8 at one of
+ * the upload sample rates. WAV files are read by WavDecoder, anything else
+ * (MP3, compressed WAV) goes through QAudioDecoder. Channels are averaged,
+ * PolyphaseResampler changes the rate and the samples are rounded to 8 bits.
+ *
+ * It is meant to live on its own thread (see MainWindow). The methods below
+ * can be called from any thread, they are queued to it like those of Client.
+ * finished() is emitted once for every conversion, also when it is cancelled.
+ * convert() is the blocking form, for threads without an event loop of
+ * their own, like those of a QThreadPool (see UploadQueue).
+*/
+class AudioConverter : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit AudioConverter(QObject *parent = 0);
+
+  // output is written as the audio is converted, waiting whenever it is full.
+  // it is finished or aborted before finished() is emitted
+  Q_INVOKABLE void convertToStream(QString source, int sampleRate, StreamChunkSource* output);
+
+  // output must be open for writing
+  Q_INVOKABLE void convertToFile(QString source, int sampleRate, QFile* output);
+
+  Q_INVOKABLE void cancel();
+
+  // converts on the calling thread, which must be the converter thread,
+  // and returns once done. it fails as soon as abort is set, from any thread
+  bool convert(QString source, int sampleRate, QFile* output, const QAtomicInt* abort = NULL);
+
+  // contentHashUpdate of what the last conversion to a file wrote
+  quint64 contentHash() const;
+
+private:
+  // source frames converted at a time
+  const int BLOCK_FRAMES = 4096;
+  // blocks converted before the event loop gets a turn, so cancel() gets through
+  const int BLOCKS_PER_SLICE = 16;
+
+  bool m_converting;
+  bool m_succeeded; // how the last conversion ended
+  const QAtomicInt* m_abort; // only while convert() runs
+  int m_sampleRate;
+  StreamChunkSource* m_stream;
+  QFile* m_file;
+  quint64 m_hash; // of the data written to m_file
+
+  WavDecoder m_wav;
+  bool m_isWav;
+  QAudioDecoder* m_decoder;
+  bool m_decoderFinished;
+
+  PolyphaseResampler m_resampler;
+  bool m_resamplerReady; // QAudioDecoder tells the rate with the first buffer
+  QVector<float> m_frames;
+  QVector<float> m_mono;
+  QVector<float> m_resampled;
+  QByteArray m_output;
+  QByteArray m_pending; // converted, waiting for room in m_stream
+  bool m_waiting; // for m_stream to free space
+  bool m_inputEnded;
+
+  QElapsedTimer m_clock;
+  qint64 m_inputFrames;
+
+  void start(QString source, int sampleRate);
+
+  void convertFrames(const float* frames, int count, int channels);
+
+  void writeSamples(const QVector<float>& samples);
+
+  bool flushPending();
+
+  void endOfInput();
+
+  bool isAborted();
+
+  void finish(bool success);
+
+  static bool fromAudioBuffer(const QAudioBuffer& buffer, QVector<float>& frames);
+
+private slots:
+  void processWav();
+
+  void processDecodedBuffers();
+
+  void handleDecoderFinished();
+
+  void handleDecoderError(QAudioDecoder::Error error);
+
+  void resume();
+
+signals:
+  void finished(bool success);
+
+  void log(QString message);
+
+};
+
+#endif // AUDIOCONVERTER_H
@@ -0,0 +1,35 @@
+# Protocol hot path microbenchmarks.
+# Build it on its own: qmake bench/bench.pro && make
+# Run ./tpo_info2_bench --help for options. Results go to stdout as CSV (or JSON lines)
+# so they can be kept and compared from commit to commit.
+
+QT += core serialport
+QT -= gui
+TARGET = tpo_info2_bench
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    main.cpp \
+    benchreport.cpp \
+    protocolbench.cpp \
+    clientbench.cpp \
+    ../client.cpp \
+    ../chunksource.cpp \
+    ../streamchunksource.cpp \
+    ../msgidallocator.cpp \
+    ../timerwheel.cpp \
+    ../protocol.c
+
+HEADERS += \
+    benchreport.h \
+    ../client.h \
+    ../chunksource.h \
+    ../streamchunksource.h \
+    ../msgidallocator.h \
+    ../timerwheel.h \
+    ../protocol.h \
+    ../crctables.h
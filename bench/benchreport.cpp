@@ -0,0 +1,101 @@
+#include "benchreport.h"
+#include <cstdio>
+#include <cstring>
+
+BenchReport::BenchReport(bool json)
+{
+  m_json = json;
+
+  if(!m_json)
+    printf("benchmark,variant,integrity,framing,payload,frames,bytes,seconds,frames_per_s,mb_per_s,resyncs\n");
+}
+
+void BenchReport::add(const BenchResult& result)
+{
+  double framesPerSecond = result.frames / result.seconds;
+  double megabytesPerSecond = result.bytes / result.seconds / 1e6;
+
+  if(m_json)
+    printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"integrity\":\"%s\",\"framing\":\"%s\","
+           "\"payload\":%d,\"frames\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+           "\"frames_per_s\":%.1f,\"mb_per_s\":%.3f,\"resyncs\":%llu}\n",
+           result.benchmark.c_str(), result.variant.c_str(),
+           integrityName(result.integrity), framingName(result.framing),
+           result.payload, (unsigned long long) result.frames, (unsigned long long) result.bytes,
+           result.seconds, framesPerSecond, megabytesPerSecond, (unsigned long long) result.resyncs);
+  else
+    printf("%s,%s,%s,%s,%d,%llu,%llu,%.6f,%.1f,%.3f,%llu\n",
+           result.benchmark.c_str(), result.variant.c_str(),
+           integrityName(result.integrity), framingName(result.framing),
+           result.payload, (unsigned long long) result.frames, (unsigned long long) result.bytes,
+           result.seconds, framesPerSecond, megabytesPerSecond, (unsigned long long) result.resyncs);
+
+  fflush(stdout);
+}
+
+BenchTimer::BenchTimer()
+{
+  m_start = std::chrono::steady_clock::now();
+}
+
+double BenchTimer::elapsed() const
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+const char* integrityName(integrity_mode_t integrity)
+{
+  switch(integrity){
+    case INTEGRITY_CRC16:
+      return "crc16";
+    case INTEGRITY_CRC32:
+      return "crc32";
+    default:
+      return "xor";
+  }
+}
+
+const char* framingName(framing_mode_t framing)
+{
+  return framing == FRAMING_COBS ? "cobs" : "sof_eof";
+}
+
+size_t encodeTestFrame(integrity_mode_t integrity, framing_mode_t framing,
+                       uint8_t msgId, const uint8_t* data, uint16_t length, uint8_t* out)
+{
+  message_hdr_t message;
+  uint32_t checksum;
+  uint8_t trailer[MAX_CHECKSUM_SIZE];
+  uint8_t size = protocolChecksumSize(integrity);
+  size_t frameLength = 0;
+
+  message.data_length = length;
+  message.msg_id = msgId;
+  message.msg_full_type = 0;
+  message.msg_type = MESSAGE_FILECHUNK;
+  message.is_response = 1;
+
+  checksum = messageGetIntegrity(integrity, &message, (uint8_t*) data);
+  for(uint8_t i = 0; i < size; i++)
+    trailer[i] = (uint8_t) (checksum >> (8 * i));
+
+  if(framing == FRAMING_COBS)
+  {
+    cobs_encoder_t encoder;
+    cobsEncoderInit(&encoder, out);
+    cobsEncoderUpdate(&encoder, (uint8_t*) &message, sizeof(message));
+    cobsEncoderUpdate(&encoder, data, length);
+    cobsEncoderUpdate(&encoder, trailer, size);
+    return cobsEncoderFinish(&encoder);
+  }
+
+  out[frameLength++] = START_OF_FRAME;
+  memcpy(out + frameLength, &message, sizeof(message));
+  frameLength += sizeof(message);
+  memcpy(out + frameLength, data, length);
+  frameLength += length;
+  memcpy(out + frameLength, trailer, size);
+  frameLength += size;
+  out[frameLength++] = END_OF_FRAME;
+  return frameLength;
+}
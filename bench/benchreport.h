@@ -0,0 +1,63 @@
+#ifndef BENCHREPORT_H
+#define BENCHREPORT_H
+
+#include <chrono>
+#include <string>
+#include "protocol.h"
+
+struct BenchOptions
+{
+  double minSeconds;    // every case runs at least this long
+  double bitErrorRate;  // for the corrupted stream cases
+  bool json;            // JSON lines instead of CSV
+};
+
+struct BenchResult
+{
+  std::string benchmark;
+  std::string variant;
+  integrity_mode_t integrity;
+  framing_mode_t framing;
+  int payload;          // message data length
+  uint64_t frames;      // frames built, or received ok
+  uint64_t bytes;       // bytes processed
+  double seconds;
+  uint64_t resyncs;
+};
+
+// prints every result as soon as it is added
+class BenchReport
+{
+public:
+  explicit BenchReport(bool json);
+
+  void add(const BenchResult& result);
+
+private:
+  bool m_json;
+};
+
+// monotonic stopwatch, started on construction
+class BenchTimer
+{
+public:
+  BenchTimer();
+
+  double elapsed() const;
+
+private:
+  std::chrono::steady_clock::time_point m_start;
+};
+
+const char* integrityName(integrity_mode_t integrity);
+const char* framingName(framing_mode_t framing);
+
+// writes a FILECHUNK like response frame to out, returns its length
+size_t encodeTestFrame(integrity_mode_t integrity, framing_mode_t framing,
+                       uint8_t msgId, const uint8_t* data, uint16_t length, uint8_t* out);
+
+void runProtocolBenchmarks(const BenchOptions& options, BenchReport& report);
+
+void runClientBenchmarks(const BenchOptions& options, BenchReport& report);
+
+#endif // BENCHREPORT_H
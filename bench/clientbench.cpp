@@ -0,0 +1,132 @@
+#include "benchreport.h"
+#include "client.h"
+#include "msgidallocator.h"
+#include <vector>
+
+static const int PAYLOAD_SIZES[] = { 16, 64, 256, MAX_MESSAGE_DATA_LENGTH };
+
+enum FramerVariant
+{
+  FRAMER_NEW_BUFFER,    // a QByteArray per frame
+  FRAMER_REUSED_BUFFER, // the same QByteArray for every frame
+  FRAMER_FIXED_BUFFER,  // chunk_id and data written straight to a fixed buffer, like sendFileChunk
+};
+
+static void benchmarkFramer(const BenchOptions& options, BenchReport& report,
+                            integrity_mode_t integrity, framing_mode_t framing,
+                            int payload, FramerVariant variant)
+{
+  std::vector<uint8_t> data(payload, 0xFA); // worst case for COBS is no zeros at all
+  message_hdr_t message;
+  QByteArray reused;
+  static uint8_t fixed[MAX_FRAME_LENGTH];
+  uint32_t chunkId = 0;
+  BenchResult result;
+
+  message.data_length = payload;
+  message.msg_id = 0;
+  message.msg_full_type = 0;
+  message.msg_type = MESSAGE_FILECHUNK;
+
+  result.benchmark = "frame";
+  switch(variant){
+    case FRAMER_NEW_BUFFER:
+      result.variant = "encodeFrame+new_buffer";
+      break;
+    case FRAMER_REUSED_BUFFER:
+      result.variant = "encodeFrame+reused_buffer";
+      break;
+    case FRAMER_FIXED_BUFFER:
+      result.variant = "encodeFrame+fixed_buffer";
+      break;
+  }
+  result.integrity = integrity;
+  result.framing = framing;
+  result.payload = payload;
+  result.frames = 0;
+  result.bytes = 0;
+  result.resyncs = 0;
+
+  BenchTimer timer;
+  do{
+    for(int i = 0; i < 256; i++)
+    {
+      message.msg_id = i % 16;
+      if(variant == FRAMER_FIXED_BUFFER)
+      {
+        chunkId++;
+        result.bytes += Client::encodeFrame(integrity, framing, &message, (uint8_t*) &chunkId, sizeof(chunkId),
+                                            data.data(), fixed);
+      }
+      else if(variant == FRAMER_REUSED_BUFFER)
+      {
+        Client::encodeFrame(integrity, framing, &message, data.data(), reused);
+        result.bytes += reused.size();
+      }
+      else
+      {
+        QByteArray frame;
+        Client::encodeFrame(integrity, framing, &message, data.data(), frame);
+        result.bytes += frame.size();
+      }
+    }
+    result.frames += 256;
+  } while(timer.elapsed() < options.minSeconds);
+  result.seconds = timer.elapsed();
+
+  report.add(result);
+}
+
+// allocate and release msg ids with the window kept full, payload is the window
+static void benchmarkMsgIds(const BenchOptions& options, BenchReport& report, int idSpace, int window)
+{
+  MsgIdAllocator allocator;
+  BenchResult result;
+
+  allocator.configure(idSpace, window);
+  while(!allocator.isFull())
+    allocator.allocate();
+
+  result.benchmark = "msg_id";
+  result.variant = "allocate+release";
+  result.integrity = INTEGRITY_XOR;
+  result.framing = FRAMING_SOF_EOF;
+  result.payload = window;
+  result.frames = 0;
+  result.bytes = 0;
+  result.resyncs = 0;
+
+  int oldest = 0;
+  BenchTimer timer;
+  do{
+    for(int i = 0; i < 1024; i++)
+    {
+      // responses come back in order: the oldest id is released first
+      allocator.release(oldest);
+      oldest = (oldest + 1) % idSpace;
+      while(!allocator.isUsed(oldest))
+        oldest = (oldest + 1) % idSpace;
+      allocator.allocate();
+    }
+    result.frames += 1024;
+  } while(timer.elapsed() < options.minSeconds);
+  result.seconds = timer.elapsed();
+
+  report.add(result);
+}
+
+void runClientBenchmarks(const BenchOptions& options, BenchReport& report)
+{
+  for(int framing = FRAMING_SOF_EOF; framing < FRAMING_MAX_VALID_MODE; framing++)
+    for(int integrity = INTEGRITY_XOR; integrity < INTEGRITY_MAX_VALID_MODE; integrity++)
+      for(int payload : PAYLOAD_SIZES)
+      {
+        benchmarkFramer(options, report, (integrity_mode_t) integrity, (framing_mode_t) framing, payload, FRAMER_NEW_BUFFER);
+        benchmarkFramer(options, report, (integrity_mode_t) integrity, (framing_mode_t) framing, payload, FRAMER_REUSED_BUFFER);
+        if(payload >= (int) sizeof(uint32_t))
+          benchmarkFramer(options, report, (integrity_mode_t) integrity, (framing_mode_t) framing, payload, FRAMER_FIXED_BUFFER);
+      }
+
+  benchmarkMsgIds(options, report, LEGACY_MSG_WINDOW, LEGACY_MSG_WINDOW);
+  benchmarkMsgIds(options, report, MsgIdAllocator::MAX_IDS, MAX_MSG_WINDOW);
+}
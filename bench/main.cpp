@@ -0,0 +1,40 @@
+#include "benchreport.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static void usage(const char* program)
+{
+  printf("usage: %s [--min-time seconds] [--ber rate] [--json]\n"
+         "  --min-time  minimum run time of every case (default 0.2)\n"
+         "  --ber       bit error rate of the corrupted stream cases (default 1e-5)\n"
+         "  --json      one JSON object per line instead of CSV\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+  BenchOptions options;
+  options.minSeconds = 0.2;
+  options.bitErrorRate = 1e-5;
+  options.json = false;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--min-time") && i + 1 < argc)
+      options.minSeconds = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--ber") && i + 1 < argc)
+      options.bitErrorRate = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--json"))
+      options.json = true;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  BenchReport report(options.json);
+  runProtocolBenchmarks(options, report);
+  runClientBenchmarks(options, report);
+  return 0;
+}
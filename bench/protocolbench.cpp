@@ -0,0 +1,236 @@
+#include "benchreport.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const int PAYLOAD_SIZES[] = { 16, 64, 256, MAX_MESSAGE_DATA_LENGTH };
+static const size_t STREAM_BYTES = 256 * 1024;
+static const size_t READ_SIZE = 4096; // what a serial read may return at high baud rates
+
+// deterministic pseudo random numbers, so runs can be compared
+static uint32_t nextRandom(uint32_t* state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// back to back FILECHUNK frames, about STREAM_BYTES long
+static std::vector<uint8_t> buildStream(integrity_mode_t integrity, framing_mode_t framing,
+                                        int payload, uint64_t* frames)
+{
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> frame(COBS_MAX_ENCODED_LENGTH(MAX_MESSAGE_LENGTH + MAX_CHECKSUM_SIZE) + 2);
+  std::vector<uint8_t> data(payload);
+  uint32_t random = 0x12345678;
+  uint32_t chunkId = 0;
+
+  *frames = 0;
+  while(stream.size() < STREAM_BYTES)
+  {
+    for(int i = 0; i < payload; i++)
+      data[i] = (uint8_t) nextRandom(&random);
+    if(payload >= (int) sizeof(chunkId))
+      memcpy(data.data(), &chunkId, sizeof(chunkId));
+    chunkId++;
+
+    size_t length = encodeTestFrame(integrity, framing, (uint8_t) (*frames % 16), data.data(), payload, frame.data());
+    stream.insert(stream.end(), frame.begin(), frame.begin() + length);
+    (*frames)++;
+  }
+  return stream;
+}
+
+// flips bits of the stream with the given probability per bit
+static uint64_t corruptStream(std::vector<uint8_t>& stream, double bitErrorRate)
+{
+  uint32_t random = 0x9E3779B9;
+  uint64_t flips = 0;
+
+  if(bitErrorRate <= 0)
+    return 0;
+
+  // distance to the next flipped bit is geometric
+  double bit = 0;
+  double totalBits = stream.size() * 8.0;
+  for(;;)
+  {
+    double u = (nextRandom(&random) + 1.0) / 4294967297.0;
+    bit += 1 + (uint64_t) (log(u) / log(1.0 - bitErrorRate));
+    if(bit >= totalBits)
+      break;
+    stream[(size_t) bit / 8] ^= (uint8_t) (1 << ((size_t) bit % 8));
+    flips++;
+  }
+  return flips;
+}
+
+enum ParseVariant
+{
+  PARSE_LEGACY,  // one push per byte, malloc'ed pop
+  PARSE_BLOCK,   // block push, peek or pop into a buffer
+};
+
+// feeds the whole stream to the parser like Client::readSerialData does
+static uint64_t parseStream(protocol_ctx_t* ctx, const std::vector<uint8_t>& stream, ParseVariant variant)
+{
+  static uint8_t buffer[MAX_MESSAGE_LENGTH];
+  uint64_t frames = 0;
+  size_t position = 0;
+
+  while(position < stream.size())
+  {
+    size_t readLength = stream.size() - position;
+    if(readLength > READ_SIZE)
+      readLength = READ_SIZE;
+
+    const uint8_t* pending = stream.data() + position;
+    size_t pendingLength = readLength;
+    position += readLength;
+
+    do{
+      size_t pushed;
+
+      if(variant == PARSE_LEGACY)
+      {
+        // small slices, so a partial frame plus the slice always fit the ring
+        pushed = pendingLength < RAW_RX_BUFFER_SIZE / 4 ? pendingLength : RAW_RX_BUFFER_SIZE / 4;
+        for(size_t i = 0; i < pushed; i++)
+          messagesBufferPushCtx(ctx, pending[i]);
+      }
+      else
+      {
+        pushed = messagesBufferPushBlockCtx(ctx, pending, pendingLength);
+      }
+      pending += pushed;
+      pendingLength -= pushed;
+
+      buffer_status_t status;
+      do{
+        status = messagesBufferProcessCtx(ctx);
+        if(status != BUFFER_MSG_OK)
+          continue;
+
+        if(variant == PARSE_LEGACY)
+        {
+          free(messagesBufferPopCtx(ctx));
+        }
+        else
+        {
+          uint16_t length;
+          if(messagesBufferPeekCtx(ctx, &length) != NULL)
+            messagesBufferReleaseCtx(ctx);
+          else
+            messagesBufferPopIntoCtx(ctx, buffer, sizeof(buffer));
+        }
+        frames++;
+      } while(status == BUFFER_MSG_OK || status >= BUFFER_ERROR_SOF_EXPECTED);
+
+    } while(pendingLength > 0);
+  }
+
+  return frames;
+}
+
+static void benchmarkParser(const BenchOptions& options, BenchReport& report,
+                            const char* name, integrity_mode_t integrity, framing_mode_t framing,
+                            int payload, ParseVariant variant, double bitErrorRate)
+{
+  uint64_t streamFrames;
+  std::vector<uint8_t> stream = buildStream(integrity, framing, payload, &streamFrames);
+  protocol_ctx_t ctx;
+  BenchResult result;
+
+  corruptStream(stream, bitErrorRate);
+
+  protocolCtxInit(&ctx);
+  protocolCtxSetModes(&ctx, integrity, framing);
+  ctx.resync_mode = RESYNC_NEXT_SOF;
+
+  result.benchmark = name;
+  result.variant = variant == PARSE_LEGACY ? "byte_push+malloc_pop" : "block_push+peek";
+  result.integrity = integrity;
+  result.framing = framing;
+  result.payload = payload;
+  result.frames = 0;
+  result.bytes = 0;
+
+  BenchTimer timer;
+  do{
+    result.frames += parseStream(&ctx, stream, variant);
+    result.bytes += stream.size();
+  } while(timer.elapsed() < options.minSeconds);
+  result.seconds = timer.elapsed();
+  result.resyncs = ctx.resync_count;
+
+  report.add(result);
+}
+
+static void benchmarkChecksum(const BenchOptions& options, BenchReport& report,
+                              integrity_mode_t integrity, int payload, bool legacy)
+{
+  std::vector<uint8_t> data(payload, 0x5A);
+  message_hdr_t message;
+  volatile uint32_t sink = 0;
+  BenchResult result;
+
+  message.data_length = payload;
+  message.msg_id = 0;
+  message.msg_full_type = 0;
+  message.msg_type = MESSAGE_FILECHUNK;
+
+  result.benchmark = "checksum";
+  result.variant = legacy ? "messageGetChecksum" : "messageGetIntegrity";
+  result.integrity = integrity;
+  result.framing = FRAMING_SOF_EOF;
+  result.payload = payload;
+  result.frames = 0;
+  result.bytes = 0;
+  result.resyncs = 0;
+
+  BenchTimer timer;
+  do{
+    for(int i = 0; i < 1024; i++)
+    {
+      data[0] = (uint8_t) i;
+      if(legacy)
+        sink = sink + messageGetChecksum(&message, data.data());
+      else
+        sink = sink + messageGetIntegrity(integrity, &message, data.data());
+    }
+    result.frames += 1024;
+    result.bytes += 1024 * (sizeof(message) + payload);
+  } while(timer.elapsed() < options.minSeconds);
+  result.seconds = timer.elapsed();
+
+  report.add(result);
+}
+
+void runProtocolBenchmarks(const BenchOptions& options, BenchReport& report)
+{
+  for(int payload : PAYLOAD_SIZES)
+  {
+    benchmarkChecksum(options, report, INTEGRITY_XOR, payload, true);
+    for(int integrity = INTEGRITY_XOR; integrity < INTEGRITY_MAX_VALID_MODE; integrity++)
+      benchmarkChecksum(options, report, (integrity_mode_t) integrity, payload, false);
+  }
+
+  // clean streams. the biggest payload is a full FILECHUNK, whose frames wrap the ring
+  for(int framing = FRAMING_SOF_EOF; framing < FRAMING_MAX_VALID_MODE; framing++)
+    for(int integrity = INTEGRITY_XOR; integrity < INTEGRITY_MAX_VALID_MODE; integrity++)
+      for(int payload : PAYLOAD_SIZES)
+      {
+        benchmarkParser(options, report, "parse", (integrity_mode_t) integrity, (framing_mode_t) framing,
+                        payload, PARSE_LEGACY, 0);
+        benchmarkParser(options, report, "parse", (integrity_mode_t) integrity, (framing_mode_t) framing,
+                        payload, PARSE_BLOCK, 0);
+      }
+
+  // corrupted streams: frames counts the ones that got through
+  for(int framing = FRAMING_SOF_EOF; framing < FRAMING_MAX_VALID_MODE; framing++)
+    for(int integrity = INTEGRITY_XOR; integrity < INTEGRITY_MAX_VALID_MODE; integrity++)
+      benchmarkParser(options, report, "parse_corrupted", (integrity_mode_t) integrity, (framing_mode_t) framing,
+                      MAX_MESSAGE_DATA_LENGTH, PARSE_BLOCK, options.bitErrorRate);
+}
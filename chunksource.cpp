@@ -0,0 +1,77 @@
+#include "chunksource.h"
+
+FileChunkSource::FileChunkSource()
+{
+  m_file = NULL;
+  m_size = 0;
+  m_map = NULL;
+  m_bufferFirstChunk = -1;
+  m_bufferLength = 0;
+}
+
+FileChunkSource::~FileChunkSource()
+{
+  close();
+}
+
+bool FileChunkSource::open(QFile *file)
+{
+  close();
+
+  if(file == NULL || !file->isOpen())
+    return false;
+
+  m_file = file;
+  m_size = file->size();
+  if(m_size > 0)
+    m_map = file->map(0, m_size);
+
+  return true;
+}
+
+void FileChunkSource::close()
+{
+  if(m_map != NULL)
+    m_file->unmap(m_map);
+
+  m_file = NULL;
+  m_size = 0;
+  m_map = NULL;
+  m_bufferFirstChunk = -1;
+  m_bufferLength = 0;
+}
+
+bool FileChunkSource::isMapped() const
+{
+  return m_map != NULL;
+}
+
+const uint8_t* FileChunkSource::chunk(uint32_t index, uint16_t* length)
+{
+  qint64 offset = (qint64) index * FILECHUNK_SIZE;
+
+  if(m_file == NULL || offset >= m_size)
+    return NULL;
+
+  *length = (uint16_t) qMin((qint64) FILECHUNK_SIZE, m_size - offset);
+
+  if(m_map != NULL)
+    return m_map + offset;
+
+  // not in the buffer: read it and the ones after it
+  if(m_bufferFirstChunk < 0 || index < m_bufferFirstChunk ||
+     index >= m_bufferFirstChunk + READ_AHEAD_CHUNKS)
+  {
+    m_bufferFirstChunk = -1;
+    if(!m_file->seek(offset))
+      return NULL;
+
+    m_bufferLength = m_file->read((char*) m_buffer, sizeof(m_buffer));
+    if(m_bufferLength < *length)
+      return NULL;
+
+    m_bufferFirstChunk = index;
+  }
+
+  return m_buffer + (index - m_bufferFirstChunk) * FILECHUNK_SIZE;
+}
@@ -0,0 +1,44 @@
+#ifndef CHUNKSOURCE_H
+#define CHUNKSOURCE_H
+
+#include <QFile>
+#include "protocol.h"
+
+/*
+ * Gives the data of every FILECHUNK of a file being uploaded, without copies
+ * or allocations per chunk.
+ * The file is memory mapped when possible. When it is not (some file systems,
+ * empty files), chunks are read two at a time into a fixed buffer, so in order
+ * uploads need a single read for every couple of chunks.
+*/
+class FileChunkSource
+{
+public:
+  FileChunkSource();
+  ~FileChunkSource();
+
+  bool open(QFile* file);
+
+  void close();
+
+  bool isMapped() const;
+
+  // returns the chunk data and its length, NULL if it could not be read.
+  // the data is only valid until the next call
+  const uint8_t* chunk(uint32_t index, uint16_t* length);
+
+private:
+  static const int READ_AHEAD_CHUNKS = 2;
+
+  QFile* m_file;
+  qint64 m_size;
+  uchar* m_map;
+
+  // read-ahead fallback
+  uint8_t m_buffer[READ_AHEAD_CHUNKS * FILECHUNK_SIZE];
+  qint64 m_bufferFirstChunk; // -1 if the buffer is empty
+  qint64 m_bufferLength;
+
+};
+
+#endif // CHUNKSOURCE_H
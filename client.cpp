@@ -1,29 +1,54 @@
 #include "client.h"
 
 Client::Client(QObject *parent) :
-  QObject(parent)
+  QObject(parent),
+  m_timers(TICK_MS)
 {
   m_audioFile = NULL;
-  m_pendingMessagesMask.resize(MAX_CONCURRENT_MESSAGES);
-  m_pendingMessagesMask.fill(false);
+  m_stream = NULL;
+  m_streamingEnabled.store(0);
+  m_finalHeaderSent = false;
+  m_streamReleased = 0;
+  protocolCtxInit(&m_rxContext);
+  m_rxContext.resync_mode = RESYNC_NEXT_SOF;
+  m_txBatchLength = 0;
+  m_txFlushQueued = false;
+  m_fileSendWindow = MAX_MSG_WINDOW;
+  m_ackClocked = true;
+  for(int i = 0; i < MsgIdAllocator::MAX_IDS; i++)
+  {
+    m_pendingRequests[i].hasReply = false;
+    m_pendingRequests[i].timer.tag = TIMER_REQUEST;
+    m_pendingRequests[i].timer.id = i;
+  }
+  m_hasFileReply = false;
+  m_heartbeatEnabled = false;
+  m_dedupEnabled = false;
+  for(int i = 0; i < LANE_COUNT; i++)
+    m_laneInFlight[i] = 0;
   m_serialPort = new QSerialPort(this);
-  m_deviceStatus = new status_hdr_t;
-  m_fileList = new QList<QString>();
+  m_serialPortOpen.store(0);
+  memset(&m_deviceStatus, 0, sizeof(m_deviceStatus));
+
+  // types crossing threads in queued signals and calls
+  qRegisterMetaType<status_hdr_t>("status_hdr_t");
+  qRegisterMetaType<command_type_t>("command_type_t");
+  qRegisterMetaType<uint32_t>("uint32_t");
 
-  // a single signal!!!
   connect(m_serialPort, SIGNAL(readyRead()), this, SLOT(readSerialData()));
+  connect(m_serialPort, SIGNAL(bytesWritten(qint64)), this, SLOT(handleBytesWritten()));
+  connect(m_serialPort, SIGNAL(error(QSerialPort::SerialPortError)), this, SLOT(handleSerialError(QSerialPort::SerialPortError)));
 
   //timers
-  m_fileSendTimer = new QTimer(this);
-  m_keepAliveTimer = new QTimer(this);
-  m_deadLineTimer =  new QTimer(this);
-  m_fileSendTimer->setInterval(150); //fake some delay
-  m_keepAliveTimer->setInterval(1500);
-  m_deadLineTimer->setInterval(5000);
-  connect(m_fileSendTimer, SIGNAL(timeout()), this, SLOT(processFileSend()));
-  connect(m_keepAliveTimer, SIGNAL(timeout()), this, SLOT(keepAlive()));
-  connect(m_deadLineTimer, SIGNAL(timeout()), this, SLOT(deadLine()));
-  m_keepAliveTimer->start();
+  m_idleProbeTimer.tag = TIMER_IDLE_PROBE;
+  m_deadLineTimer.tag = TIMER_DEAD_LINK;
+  m_fileSendTimer.tag = TIMER_FILE_SEND;
+  m_idleProbeInterval = IDLE_PROBE_MS;
+  m_tickTimer = new QTimer(this);
+  m_tickTimer->setInterval(TICK_MS);
+  connect(m_tickTimer, SIGNAL(timeout()), this, SLOT(processTimers()));
+  m_clock.start();
+  armTimer(&m_idleProbeTimer, m_idleProbeInterval); // restarted by every frame received
 
 
 }
@@ -31,64 +56,304 @@ Client::Client(QObject *parent) :
 Client::~Client()
 {
   delete m_serialPort;
-  delete m_fileList;
-  delete m_deviceStatus;
 
-  delete m_fileSendTimer;
-  delete m_keepAliveTimer;
-  delete m_deadLineTimer;
+  delete m_tickTimer;
 
 }
 
 void Client::sendHandshakeRequest()
 {
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "sendHandshakeRequest", Qt::QueuedConnection);
+    return;
+  }
+
   message_hdr_t request;
-  if (!pendingFull())
+  handshake_data_t handshake;
+  if (laneHasSlot(LANE_LIVENESS))
   {
-    request.data_length = 0;
+    // tell the device which integrity checks and framings we support
+    memset(&handshake, 0, sizeof(handshake));
+    handshake.integrity = INTEGRITY_FLAG(INTEGRITY_XOR)
+        | INTEGRITY_FLAG(INTEGRITY_CRC16)
+        | INTEGRITY_FLAG(INTEGRITY_CRC32);
+    handshake.framing = FRAMING_FLAG(FRAMING_SOF_EOF)
+        | FRAMING_FLAG(FRAMING_COBS);
+    handshake.window = MAX_MSG_WINDOW;
+    handshake.features = FEATURE_HEARTBEAT | FEATURE_STREAMING | FEATURE_DEDUP;
+
+    request.data_length = sizeof(handshake);
     request.is_response = 0;
     request.msg_type = MESSAGE_HANDSHAKE;
-    //no data.... bodyless message
-    sendMessageRequest(&request, NULL);
+    sendMessageRequest(&request, (uint8_t*) &handshake);
   }
 }
 
 void Client::sendCommandRequest(command_type_t command)
 {
-  message_hdr_t request;
-  if (canSendMessage())
+  sendCommandAsync(command);
+}
+
+void Client::getDeviceStatus()
+{
+  getDeviceStatusAsync();
+}
+
+void Client::sendFile(QFile *file, uint32_t sampleRate, QString filename)
+{
+  sendFileAsync(file, sampleRate, filename);
+}
+
+QFuture<RequestReply> Client::sendCommandAsync(command_type_t command)
+{
+  QueuedRequest request;
+  request.msgType = MESSAGE_COMMAND;
+  request.data.append((char) command);
+  request.file = NULL;
+  request.stream = NULL;
+  return queueRequest(request);
+}
+
+QFuture<RequestReply> Client::getDeviceStatusAsync()
+{
+  QueuedRequest request;
+  request.msgType = MESSAGE_INFO_STATUS; //no data.... bodyless message
+  request.file = NULL;
+  request.stream = NULL;
+  return queueRequest(request);
+}
+
+QFuture<RequestReply> Client::sendFileAsync(QFile *file, uint32_t sampleRate, QString filename, quint64 contentHash)
+{
+  fileheader_data_t header;
+  QueuedRequest request;
+
+  memset(&header, 0, sizeof(header));
+  header.sample_rate = sampleRate;
+  header.length = file != NULL ? file->size() : 0;
+  strncpy(header.filename, filename.toLatin1().data() ,8);
+  fileheaderSetContentHash(&header, contentHash);
+
+  header.chunks_count = header.length / FILECHUNK_SIZE;
+  if((header.length % FILECHUNK_SIZE) > 0)
+    header.chunks_count++;
+
+  request.msgType = MESSAGE_FILEHEADER;
+  request.data = QByteArray((const char*) &header, sizeof(header));
+  request.file = file;
+  request.stream = NULL;
+  return queueRequest(request);
+}
+
+/*
+ * length and chunks_count are not known yet: they go in the final header,
+ * sent again once the stream is finished and all its chunks were answered
+*/
+QFuture<RequestReply> Client::sendStreamAsync(StreamChunkSource* stream, uint32_t sampleRate, QString filename)
+{
+  fileheader_data_t header;
+  QueuedRequest request;
+
+  memset(&header, 0, sizeof(header));
+  header.sample_rate = sampleRate;
+  strncpy(header.filename, filename.toLatin1().data() ,8);
+
+  request.msgType = MESSAGE_FILEHEADER;
+  request.data = QByteArray((const char*) &header, sizeof(header));
+  request.file = NULL;
+  request.stream = stream;
+  return queueRequest(request);
+}
+
+bool Client::isStreamingSupported() const
+{
+  return m_streamingEnabled.load() != 0;
+}
+
+/*
+ * can be called from any thread. the request is sent later from the client thread
+*/
+QFuture<RequestReply> Client::queueRequest(QueuedRequest& request)
+{
+  QFuture<RequestReply> future;
+
+  request.reply.reportStarted();
+  future = request.reply.future();
+
+  request.queuedAt = m_clock.elapsed();
+
+  m_requestQueueMutex.lock();
+  int queued = m_fileQueue.size();
+  for(int lane = 0; lane < LANE_COUNT; lane++)
+    queued += m_requestQueue[lane].size();
+
+  if(queued >= MAX_QUEUED_REQUESTS)
   {
-    request.data_length = 1;
-    request.is_response = 0;
-    request.msg_type = MESSAGE_COMMAND;
-    sendMessageRequest(&request, (uint8_t*) &command);
+    m_requestQueueMutex.unlock();
+    resolveReply(request.reply, REQUEST_QUEUE_FULL);
+    return future;
   }
+
+  if(request.msgType == MESSAGE_FILEHEADER)
+    m_fileQueue.append(request);
+  else
+    m_requestQueue[laneOf(request.msgType)].append(request);
+  m_requestQueueMutex.unlock();
+
+  QMetaObject::invokeMethod(this, "processRequestQueue", Qt::QueuedConnection);
+  return future;
 }
 
-void Client::getDeviceStatus()
+/*
+ * sends queued requests while their lane has free slots, higher priority lanes
+ * first and in the order they came within a lane.
+ * called again every time a msg id is freed or the device shows up
+*/
+void Client::processRequestQueue()
+{
+  if(!m_serialPort->isOpen() || m_deviceConnected == 0)
+  {
+    failRequests(REQUEST_DISCONNECTED);
+    return;
+  }
+
+  if(m_deviceConnected != 1)
+    return; // not detected yet, keep them
+
+  QMutexLocker locker(&m_requestQueueMutex);
+
+  for(int lane = 0; lane < LANE_COUNT; lane++)
+    while(!m_requestQueue[lane].isEmpty() && canSendMessage((RequestLane) lane))
+    {
+      QueuedRequest next = m_requestQueue[lane].takeFirst();
+      message_hdr_t request;
+
+      request.data_length = next.data.size();
+      request.is_response = 0;
+      request.msg_type = next.msgType;
+      int msg_id = sendMessageRequest(&request, (uint8_t*) next.data.data());
+
+      PendingRequest& pending = m_pendingRequests[msg_id];
+      pending.hasReply = true;
+      pending.reply = next.reply;
+      pending.queuedAt = next.queuedAt;
+    }
+
+  if(!m_fileQueue.isEmpty() && !isTransferring())
+  {
+    QueuedRequest next = m_fileQueue.takeFirst();
+    locker.unlock();
+    startFileTransfer(next);
+  }
+}
+
+void Client::startFileTransfer(QueuedRequest& request)
 {
-  m_fileList->clear();
+  if(request.stream != NULL)
+  {
+    if(!isStreamingSupported())
+    {
+      emit log(QString("The device does not support streaming uploads."));
+      resolveReply(request.reply, REQUEST_REJECTED);
+      emit sendFileFinished(false);
+      return;
+    }
+    m_stream = request.stream;
+    // written from the producer thread
+    connect(m_stream, SIGNAL(dataAvailable()), this, SLOT(handleStreamData()), Qt::QueuedConnection);
+  }
+  else
+  {
+    if(!m_chunkSource.open(request.file))
+    {
+      emit log(QString("Could not open the file to send."));
+      resolveReply(request.reply, REQUEST_REJECTED);
+      emit sendFileFinished(false);
+      return;
+    }
+    m_audioFile = request.file;
+  }
+  m_hasFileReply = true;
+  m_fileReply = request.reply;
 
-  message_hdr_t request;
+  memcpy(&m_fileHeader, request.data.constData(), sizeof(m_fileHeader));
+  // given by the caller, hashing here would hold up the link
+  if(!m_dedupEnabled)
+    fileheaderSetContentHash(&m_fileHeader, 0);
+
+  m_chunkIndex = 0;
+  m_chunksInFlight = 0;
+  m_chunksAcked = 0;
+  m_retransmitChunks.clear();
+  m_chunkRetries.clear();
+  m_fileHeaderSent = false;
+  m_fileHeaderAcepted = false;
+  m_finalHeaderSent = false;
+  m_streamReleased = 0;
+  m_streamAcked.clear();
 
-  if (canSendMessage())
+  if(m_ackClocked)
+    processFileSend(); // next steps are triggered by responses
+  else
+    armTimer(&m_fileSendTimer, FILE_SEND_INTERVAL_MS);
+}
+
+/*
+ * ends every request still waiting, queued or sent, with the given error
+*/
+void Client::failRequests(RequestError error)
+{
+  QList<QueuedRequest> queued;
+
+  m_requestQueueMutex.lock();
+  for(int lane = 0; lane < LANE_COUNT; lane++)
   {
-    request.data_length = 0;
-    request.is_response = 0;
-    request.msg_type = MESSAGE_INFO_STATUS;
-    //no data.... bodyless message
-    sendMessageRequest(&request, NULL);
+    queued += m_requestQueue[lane];
+    m_requestQueue[lane].clear();
   }
+  queued += m_fileQueue;
+  m_fileQueue.clear();
+  m_requestQueueMutex.unlock();
+
+  for(int i = 0; i < queued.size(); i++)
+    resolveReply(queued[i].reply, error);
 
+  for(int i = 0; i < MsgIdAllocator::MAX_IDS; i++)
+  {
+    PendingRequest& pending = m_pendingRequests[i];
+    if(pending.hasReply)
+    {
+      pending.hasReply = false;
+      resolveReply(pending.reply, error);
+    }
+  }
 }
 
-QSerialPort *Client::getSerialPort()
+void Client::resolveReply(QFutureInterface<RequestReply>& reply, RequestError error, QByteArray data)
 {
-  return m_serialPort;
+  RequestReply result;
+  result.error = error;
+  result.data = data;
+  reply.reportResult(result);
+  reply.reportFinished();
 }
 
-bool Client::openSerialPort(QString port, uint16_t baudRate)
+bool Client::isSerialPortOpen() const
 {
+  return m_serialPortOpen.load() != 0;
+}
+
+bool Client::openSerialPort(QString port, qint32 baudRate)
+{
+  if(QThread::currentThread() != thread())
+  {
+    bool opened = false;
+    QMetaObject::invokeMethod(this, "openSerialPort", Qt::BlockingQueuedConnection,
+                              Q_RETURN_ARG(bool, opened), Q_ARG(QString, port), Q_ARG(qint32, baudRate));
+    return opened;
+  }
+
   m_serialPort->setPortName(port);
   m_serialPort->setBaudRate(baudRate);
   m_serialPort->setDataBits(QSerialPort::Data8);
@@ -96,94 +361,362 @@ bool Client::openSerialPort(QString port, uint16_t baudRate)
   m_serialPort->setStopBits(QSerialPort::OneStop);
   m_serialPort->setFlowControl(QSerialPort::NoFlowControl);
   m_deviceConnected = -1;
-  return m_serialPort->open(QIODevice::ReadWrite);
+  m_serialPortOpen.store(m_serialPort->open(QIODevice::ReadWrite));
+  return isSerialPortOpen();
 }
 
 void Client::closeSerialPort()
 {
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "closeSerialPort", Qt::BlockingQueuedConnection);
+    return;
+  }
+
   updateDeviceStatus(false);
+  m_txBatchLength = 0; // nothing left to write them to
   if(m_serialPort->isOpen())
     m_serialPort->close();
+  m_serialPortOpen.store(0);
+  failRequests(REQUEST_DISCONNECTED);
 }
 
-void Client::sendFile(QFile *file, uint32_t sampleRate, QString filename)
+/*
+ * errors are reported as text, QSerialPort itself must not be used outside the client thread
+*/
+void Client::handleSerialError(QSerialPort::SerialPortError error)
 {
-  m_audioFile = file;
+  if(error == QSerialPort::NoError)
+    return;
 
-  m_fileHeader.sample_rate = sampleRate;
-  m_fileHeader.length =  m_audioFile->size();
-  strncpy(m_fileHeader.filename, filename.toLatin1().data() ,8);
+  emit serialError(m_serialPort->errorString());
+}
 
-  m_fileHeader.chunks_count = m_fileHeader.length / FILECHUNK_SIZE;
-  if((m_fileHeader.length % FILECHUNK_SIZE) > 0)
-    m_fileHeader.chunks_count++;
+void Client::setFileSendWindow(int window)
+{
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "setFileSendWindow", Qt::QueuedConnection, Q_ARG(int, window));
+    return;
+  }
 
-  m_chunkIndex = 0;
-  m_fileHeaderSent = false;
-  m_fileHeaderAcepted = false;
-  m_fileSendTimer->start();
+  // the negotiated msg id window limits it further
+  m_fileSendWindow = qBound(1, window, MAX_MSG_WINDOW);
 }
 
-bool Client::canSendMessage()
+void Client::setAckClocked(bool ackClocked)
 {
-  //check if connected and not pendingFull
-  return (m_deviceConnected==1) && !pendingFull();
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "setAckClocked", Qt::QueuedConnection, Q_ARG(bool, ackClocked));
+    return;
+  }
+
+  m_ackClocked = ackClocked;
+
+  if(!isTransferring())
+    return;
+
+  // switch pacing of a transfer already in progress
+  if(m_ackClocked)
+  {
+    m_timers.cancel(&m_fileSendTimer);
+    processFileSend();
+  }
+  else
+  {
+    armTimer(&m_fileSendTimer, FILE_SEND_INTERVAL_MS);
+  }
 }
 
-bool Client::pendingFull(){
-  //check if there is an available msg id
-  return (m_pendingMessagesMask.count(false) == 0);
+bool Client::canSendMessage(RequestLane lane)
+{
+  //check if connected and the lane has a free slot
+  return (m_deviceConnected==1) && laneHasSlot(lane);
+}
+
+Client::RequestLane Client::laneOf(uint8_t msgType)
+{
+  switch(msgType){
+    case MESSAGE_COMMAND:
+      return LANE_CONTROL;
+    case MESSAGE_HANDSHAKE:
+      return LANE_LIVENESS;
+    case MESSAGE_INFO_STATUS:
+      return LANE_STATUS;
+    default:
+      return LANE_BULK;
+  }
+}
+
+/*
+ * control and liveness requests may take any free msg id. the others leave
+ * RESERVED_*_SLOTS free for them, and bulk data also waits while more than
+ * MAX_BULK_TX_BACKLOG bytes are still to be written, so a command is never
+ * queued behind a window of chunks at a low baud rate
+*/
+bool Client::laneHasSlot(RequestLane lane)
+{
+  if(m_msgIds.isFull())
+    return false;
+
+  if(lane == LANE_CONTROL || lane == LANE_LIVENESS)
+    return true;
+
+  int reserved = qMax(0, RESERVED_CONTROL_SLOTS - m_laneInFlight[LANE_CONTROL])
+      + qMax(0, RESERVED_LIVENESS_SLOTS - m_laneInFlight[LANE_LIVENESS]);
+  // a tiny window can not be all reserved
+  reserved = qMin(reserved, m_msgIds.window() - 1);
+
+  if(m_msgIds.inUse() + reserved >= m_msgIds.window())
+    return false;
+
+  if(lane == LANE_BULK)
+    return m_serialPort->bytesToWrite() + m_txBatchLength < MAX_BULK_TX_BACKLOG;
+
+  return true;
+}
+
+void Client::releaseMsgId(int msgId)
+{
+  if(!m_msgIds.isUsed(msgId))
+    return;
+
+  m_msgIds.release(msgId);
+  m_laneInFlight[m_pendingRequests[msgId].lane]--;
+  m_timers.cancel(&m_pendingRequests[msgId].timer);
+}
+
+void Client::armTimer(TimerWheel::Timer* timer, int milliseconds)
+{
+  m_timers.arm(timer, m_clock.elapsed(), milliseconds);
+  if(!m_tickTimer->isActive())
+    m_tickTimer->start();
+}
+
+/*
+ * the backlog went down, there may be room for more chunks
+*/
+void Client::handleBytesWritten()
+{
+  if(m_ackClocked && isTransferring())
+    processFileSend();
+}
+
+/*
+ * the stream got more data, or it ended
+*/
+void Client::handleStreamData()
+{
+  if(m_stream == NULL)
+    return;
+
+  if(m_stream->isAborted())
+  {
+    emit log(QString("The streamed file could not be completed."));
+    finishOrCancelFileTransfer(REQUEST_REJECTED);
+    return;
+  }
+
+  if(m_ackClocked)
+    processFileSend();
 }
 
 void Client::sendMessage(message_hdr_t* message, uint8_t* data)
 {
-  QByteArray d;
-  uint16_t i;
-  uint8_t checksum = messageGetChecksum(message, data);
+  sendMessage(message, NULL, 0, data);
+}
+
+/*
+ * the message data is prefix followed by data, so a FILECHUNK can be sent
+ * straight from the file without copying it next to its chunk_id first.
+ * frames are collected in m_txBatch and written together when control returns
+ * to the event loop, so requests sent back to back cost a single write()
+*/
+void Client::sendMessage(message_hdr_t* message, const uint8_t* prefix, uint16_t prefixLength, const uint8_t* data)
+{
+  // same modes for both directions
+  integrity_mode_t integrity = m_rxContext.integrity_mode;
+  framing_mode_t framing = m_rxContext.framing_mode;
+
+  if(m_txBatchLength + MAX_FRAME_LENGTH > (int) sizeof(m_txBatch))
+    flushTxBatch();
+
+  m_txBatchLength += encodeFrame(integrity, framing, message, prefix, prefixLength, data,
+                                 m_txBatch + m_txBatchLength);
+
+  if(!m_txFlushQueued)
+  {
+    m_txFlushQueued = true;
+    QMetaObject::invokeMethod(this, "flushTxBatch", Qt::QueuedConnection);
+  }
+}
+
+void Client::flushTxBatch()
+{
+  m_txFlushQueued = false;
 
-  d.append(START_OF_FRAME);
+  if(m_txBatchLength == 0)
+    return;
 
-  for(i = 0; i < sizeof(message_hdr_t); i++)
-    d.append( *( ((uint8_t*) message) +i) );
+  if(m_serialPort->isOpen())
+    m_serialPort->write((const char*) m_txBatch, m_txBatchLength);
+  m_txBatchLength = 0;
+}
 
-  for(i = 0; i < message->data_length ; i++)
-    d.append(*(data + i));
+/*
+ * serializes a message and its data as a frame ready to be written
+*/
+void Client::encodeFrame(integrity_mode_t integrity, framing_mode_t framing,
+                         message_hdr_t* message, uint8_t* data, QByteArray& frame)
+{
+  frame.resize(MAX_FRAME_LENGTH);
+  frame.resize(encodeFrame(integrity, framing, message, NULL, 0, data, (uint8_t*) frame.data()));
+}
+
+/*
+ * writes the frame of a message whose data is prefix followed by data.
+ * frame must hold MAX_FRAME_LENGTH bytes. returns the frame length
+*/
+int Client::encodeFrame(integrity_mode_t integrity, framing_mode_t framing,
+                        message_hdr_t* message, const uint8_t* prefix, uint16_t prefixLength,
+                        const uint8_t* data, uint8_t* frame)
+{
+  uint16_t dataLength = message->data_length - prefixLength;
+  uint8_t checksumSize = protocolChecksumSize(integrity);
+  int length = 0;
 
-  d.append(checksum);
-  d.append(END_OF_FRAME);
-  m_serialPort->write(d);
+  if(framing == FRAMING_COBS)
+  {
+    cobs_encoder_t encoder;
+    uint8_t trailer[MAX_CHECKSUM_SIZE];
+
+    // checksum and encoding go over each piece while it is in cache
+    uint32_t checksum = protocolChecksumInit(integrity);
+    cobsEncoderInit(&encoder, frame);
+    checksum = protocolChecksumUpdate(integrity, checksum, (uint8_t*) message, sizeof(message_hdr_t));
+    cobsEncoderUpdate(&encoder, (uint8_t*) message, sizeof(message_hdr_t));
+    checksum = protocolChecksumUpdate(integrity, checksum, prefix, prefixLength);
+    cobsEncoderUpdate(&encoder, prefix, prefixLength);
+    checksum = protocolChecksumUpdate(integrity, checksum, data, dataLength);
+    cobsEncoderUpdate(&encoder, data, dataLength);
+    checksum = protocolChecksumFinal(integrity, checksum);
+
+    for(uint8_t i = 0; i < checksumSize; i++)
+      trailer[i] = (uint8_t) (checksum >> (8 * i)); // little endian
+    cobsEncoderUpdate(&encoder, trailer, checksumSize);
+    return cobsEncoderFinish(&encoder);
+  }
+
+  frame[length++] = START_OF_FRAME;
+  memcpy(frame + length, message, sizeof(message_hdr_t));
+  length += sizeof(message_hdr_t);
+  if(prefixLength > 0)
+    memcpy(frame + length, prefix, prefixLength);
+  length += prefixLength;
+  if(dataLength > 0)
+    memcpy(frame + length, data, dataLength);
+  length += dataLength;
+
+  // over what was just copied, still in cache. SOF is not part of the checksum
+  uint32_t checksum = protocolChecksumInit(integrity);
+  checksum = protocolChecksumUpdate(integrity, checksum, frame + 1, length - 1);
+  checksum = protocolChecksumFinal(integrity, checksum);
+
+  for(uint8_t i = 0; i < checksumSize; i++)
+    frame[length++] = (uint8_t) (checksum >> (8 * i)); // little endian
+  frame[length++] = END_OF_FRAME;
+
+  return length;
+}
+
+/*
+ * returns the msg_id assigned to the request, or -1 if there was none free
+*/
+int Client::sendMessageRequest(message_hdr_t* message, uint8_t* data)
+{
+  return sendMessageRequest(message, NULL, 0, data);
 }
 
-void Client::sendMessageRequest(message_hdr_t* message, uint8_t* data)
+int Client::sendMessageRequest(message_hdr_t* message, const uint8_t* prefix, uint16_t prefixLength, const uint8_t* data)
 {
-  int msg_id = -1;
   // assigns a message id and flags it to check response later
-  for(int i=0;i < MAX_CONCURRENT_MESSAGES; i++)
-    if( !m_pendingMessagesMask.testBit(i))
-    {
-      msg_id = i;
-      break;
-    }
+  int msg_id = m_msgIds.allocate();
 
   if(msg_id==-1)
-    return;
+    return -1;
   else
   {
     message->msg_id = msg_id;
-    m_pendingMessagesMask.setBit(msg_id);
 
-    m_keepAliveTimer->start(); // restart
-    if(!m_deadLineTimer->isActive())
-      m_deadLineTimer->start();
+    PendingRequest& pending = m_pendingRequests[msg_id];
+    pending.msgType = message->msg_type;
+    pending.chunkId = 0;
+    pending.retries = 0;
+    pending.deadline = requestDeadline(message->data_length, 0);
+    pending.hasReply = false;
+    pending.lane = laneOf(message->msg_type);
+    pending.queuedAt = m_clock.elapsed();
+    pending.sentAt = m_clock.nsecsElapsed() / 1000;
+    m_laneInFlight[pending.lane]++;
 
-    sendMessage(message, data);
-    return;
+    armTimer(&pending.timer, pending.deadline - m_clock.elapsed());
+    if(!m_deadLineTimer.isArmed())
+      armTimer(&m_deadLineTimer, DEAD_LINK_MS);
+
+    sendMessage(message, prefix, prefixLength, data);
+    return msg_id;
 
   }
 
 
 }
 
+/*
+ * time at which a request sent now should have been answered.
+ * it accounts for the bytes still waiting to be written at the current baud rate
+ * and doubles on each retry, up to MAX_REQUEST_TIMEOUT_MS
+*/
+qint64 Client::requestDeadline(uint16_t dataLength, int retries)
+{
+  qint64 timeout = REQUEST_TIMEOUT_MS << qMin(retries, 3);
+  qint64 frameBytes = m_serialPort->bytesToWrite() + m_txBatchLength + sizeof(message_hdr_t) + dataLength + 3;
+  qint32 baudRate = m_serialPort->baudRate();
+
+  if(timeout > MAX_REQUEST_TIMEOUT_MS)
+    timeout = MAX_REQUEST_TIMEOUT_MS;
+
+  // 10 bits on the line per byte (start + 8 data + stop)
+  if(baudRate > 0)
+    timeout += frameBytes * 10 * 1000 / baudRate;
+
+  return m_clock.elapsed() + timeout;
+}
+
+/*
+ * a response may arrive after its request timed out and its msg_id was reused.
+ * check it answers what we asked for the msg_id.
+*/
+bool Client::pendingRequestMatches(message_hdr_t* response, uint8_t* data)
+{
+  const PendingRequest& pending = m_pendingRequests[response->msg_id];
+
+  if(pending.msgType != response->msg_type)
+    return false;
+
+  if(pending.msgType == MESSAGE_FILECHUNK)
+  {
+    uint32_t chunkId;
+
+    if(response->data_length < sizeof(filechunk_hdr_t))
+      return false;
+    memcpy(&chunkId, data + offsetof(filechunk_hdr_t, chunk_id), sizeof(chunkId));
+    return chunkId == pending.chunkId;
+  }
+
+  return true;
+}
+
 void Client::sendMessageResponse(message_hdr_t* message, uint8_t* data)
 {
   sendMessage(message, data);
@@ -192,89 +725,162 @@ void Client::sendMessageResponse(message_hdr_t* message, uint8_t* data)
 void Client::readSerialData()
 {
   QByteArray data = m_serialPort->readAll();
+  const uint8_t* pending = (const uint8_t*) data.constData();
+  size_t pendingLength = data.size();
 
-  //push received data to buffer
-  for(int i = 0; i < data.size(); i++)
-    messagesBufferPush( (uint8_t) data.at(i) );
-
-
+  //push received data to buffer, as much as it fits each time
   do{
-    m_bufferStatus = messagesBufferProcess();
-
-    switch(m_bufferStatus){
-      case BUFFER_NOT_SOF:
-      case BUFFER_SOF:
-      case BUFFER_IN_MSG:
-      case BUFFER_EOF:
-        //do no take any special action here
-        break;
-      case BUFFER_MSG_OK:
-        readMessageFromBuffer();
-        break;
-      case BUFFER_ERROR_SOF_EXPECTED:
-      case BUFFER_ERROR_CHECKSUM:
-      case BUFFER_ERROR_EOF_EXPECTED:
-      case BUFFER_ERROR_INVALID_MSG_LENGTH:
-        emit log(QString("Message Buffer Error: %1").arg(m_bufferStatus));
-        break;
+    size_t pushed = messagesBufferPushBlockCtx(&m_rxContext, pending, pendingLength);
+    pending += pushed;
+    pendingLength -= pushed;
+
+    do{
+      m_bufferStatus = messagesBufferProcessCtx(&m_rxContext);
+
+      switch(m_bufferStatus){
+        case BUFFER_NOT_SOF:
+        case BUFFER_SOF:
+        case BUFFER_IN_MSG:
+        case BUFFER_EOF:
+          //do no take any special action here
+          break;
+        case BUFFER_MSG_OK:
+          readMessageFromBuffer();
+          break;
+        case BUFFER_ERROR_SOF_EXPECTED:
+        case BUFFER_ERROR_CHECKSUM:
+        case BUFFER_ERROR_EOF_EXPECTED:
+        case BUFFER_ERROR_INVALID_MSG_LENGTH:
+          emit log(QString("Message Buffer Error: %1 (resync #%2)").arg(m_bufferStatus).arg(m_rxContext.resync_count + 1));
+          break;
+      }
+      // this while is controlled
+      // it only happens if more than one messages
+      // are received at once, or to resync after an error
+      // (each resync consumes at least the broken SOF)
+    } while(m_bufferStatus==BUFFER_MSG_OK || m_bufferStatus>=BUFFER_ERROR_SOF_EXPECTED);
+
+    if(pushed == 0 && pendingLength > 0)
+    {
+      // should not happen: a full buffer always holds a complete message
+      emit log(QString("Message Buffer Error: overflow"));
+      messagesBufferClearCtx(&m_rxContext);
     }
-    // this while is controlled
-    // it only happens if more than one messages
-    // are received at once
-  } while(m_bufferStatus==BUFFER_MSG_OK);
+
+  } while(pendingLength > 0);
 
 }
 
 void Client::readMessageFromBuffer()
 {
-  uint8_t* raw_data = messagesBufferPop();
-  message_hdr_t* message = (message_hdr_t*) raw_data;
+  uint16_t length;
+  uint8_t* raw_data = messagesBufferPeekCtx(&m_rxContext, &length);
+  bool inPlace = raw_data != NULL; // read it in place, no copy needed
 
+  if(!inPlace)
+  {
+    // it wraps around the rx buffer
+    length = messagesBufferPopIntoCtx(&m_rxContext, m_rxFrame, sizeof(m_rxFrame));
+    raw_data = m_rxFrame;
+  }
+
+  if(length < sizeof(message_hdr_t))
+    processMessage(NULL, NULL);
+  else
+  {
+    // a peeked message is not aligned: only its header is copied out
+    message_hdr_t header;
+    memcpy(&header, raw_data, sizeof(header));
+    processMessage(&header, raw_data + sizeof(header));
+  }
+
+  if(inPlace)
+    messagesBufferReleaseCtx(&m_rxContext);
+}
+
+void Client::processMessage(message_hdr_t* message, uint8_t* data)
+{
   //perform some common validations
 
   if(message == NULL){
     emit log(QString("Message Error: NULL_MESSAGE ."));
-    free(message);
     return;
   }
 
   if(message->msg_type >= MESSAGE_MAX_VALID_TYPE){
     emit log(QString("Message Error: INVALID_MESSAGE_TYPE ."));
-    free(message);
     return;
   }
 
   //emit log(QString("Message: %1   type: %2 id:%3.").arg(message->is_response).arg(message->msg_type).arg(message->msg_id));
 
+  // any valid frame shows the link is alive: no probes needed for a while
+  armTimer(&m_idleProbeTimer, m_idleProbeInterval);
+  if(m_deviceConnected == 1)
+    armTimer(&m_deadLineTimer, DEAD_LINK_MS);
+
+  if(message->msg_type == MESSAGE_HEARTBEAT && message->is_response)
+    return; // has no msg_id, it was only a probe
 
   if(message->is_response)
     //check if a request was made
-    if(m_pendingMessagesMask.testBit(message->msg_id))
+    if(m_msgIds.isUsed(message->msg_id)
+       && pendingRequestMatches(message, data))
     {
-      m_pendingMessagesMask.clearBit(message->msg_id);
-      processMessageResponse(message);
+      // copies, the msg id may be reused while processing the response
+      PendingRequest& pending = m_pendingRequests[message->msg_id];
+      bool hasReply = pending.hasReply;
+      QFutureInterface<RequestReply> reply = pending.reply;
+      qint64 queuedAt = pending.queuedAt;
+      qint64 sentAt = pending.sentAt;
+      pending.hasReply = false;
+      releaseMsgId(message->msg_id);
+      processMessageResponse(message, data);
+
+      if(message->msg_type == MESSAGE_COMMAND)
+        emit commandLatency(m_clock.elapsed() - queuedAt);
+      else if(message->msg_type == MESSAGE_FILECHUNK)
+        emit chunkRoundTrip(m_clock.nsecsElapsed() / 1000 - sentAt);
+
+      if(hasReply)
+      {
+        // commands answer a single status byte
+        bool rejected = message->msg_type == MESSAGE_COMMAND && *data != STATUS_OK;
+        resolveReply(reply, rejected ? REQUEST_REJECTED : REQUEST_OK,
+                     QByteArray((const char*) data, message->data_length));
+      }
       updateDeviceStatus(true);
+
+      // a msg id was freed, queued requests go before the upload
+      processRequestQueue();
+      if(m_ackClocked && isTransferring())
+        processFileSend();
     }
     else
     {
       emit log(QString("MessageError: RESPONSE_NOT_EXPECTED ."));
     }
   else{
-    processMessageRequest(message);
+    processMessageRequest(message, data);
   }
 
-  // dont forget to free(msg)!
-  free(message);
-
 }
 
 
+/*
+ * Sends the file header and then keeps up to m_fileSendWindow
+ * chunks waiting for a response.
+ * When ack-clocked, it is called again every time a response
+ * frees a msg id, so the line stays busy while there are chunks left.
+ * Otherwise it is called when m_fileSendTimer expires and sends one chunk each time.
+ * A stream sends its chunks as they are written, and its header again at the end.
+*/
 void Client::processFileSend()
 {
 
   message_hdr_t request;
 
-  if (!canSendMessage())
+  if (!isTransferring() || !canSendMessage(LANE_BULK))
     //message queue is full... wait for next iteration
     return;
 
@@ -292,54 +898,136 @@ void Client::processFileSend()
   else if(m_fileHeaderAcepted)
   {
 
-    m_audioFile->seek( FILECHUNK_SIZE * m_chunkIndex);
+    while(isTransferring() && m_chunksInFlight < (uint32_t) m_fileSendWindow && canSendMessage(LANE_BULK))
+    {
+      // lost chunks go first
+      if(!m_retransmitChunks.isEmpty())
+        sendFileChunk(m_retransmitChunks.takeFirst());
+      else if(m_stream != NULL ? m_stream->isChunkReady(m_chunkIndex) : m_chunkIndex < m_fileHeader.chunks_count)
+        sendFileChunk(m_chunkIndex++);
+      else
+        break;
 
-    char *buf = new char[FILECHUNK_SIZE];
-    qint64 dataSize = m_audioFile->read(buf, FILECHUNK_SIZE);
+      if(!m_ackClocked)
+        break; // one chunk per timer tick
+    }
 
-    QByteArray ba;
-    ba.append((char*) &m_chunkIndex,sizeof(m_chunkIndex));
-    ba.append(buf, dataSize);
-    delete buf;
-    ba.resize(sizeof(m_chunkIndex) + dataSize);
-    request.data_length = ba.size();
-    request.msg_type = MESSAGE_FILECHUNK;
-    request.is_response = 0;
-    //emit log(QString("Send chunk: %1 .").arg(m_chunkIndex));
-    sendMessageRequest(&request, (uint8_t*) ba.data());
+    if(m_stream != NULL && !m_finalHeaderSent && m_stream->isFinished()
+       && m_streamReleased == m_stream->chunksCount() && canSendMessage(LANE_BULK))
+    {
+      if(m_stream->length() == 0)
+      {
+        // a header without length would start another stream
+        emit log(QString("The streamed file is empty."));
+        finishOrCancelFileTransfer(REQUEST_REJECTED);
+        return;
+      }
 
+      m_fileHeader.length = m_stream->length();
+      m_fileHeader.chunks_count = m_stream->chunksCount();
+      if(m_dedupEnabled)
+        fileheaderSetContentHash(&m_fileHeader, m_stream->contentHash());
+      request.data_length = sizeof(m_fileHeader);
+      request.is_response = 0;
+      request.msg_type = MESSAGE_FILEHEADER;
+      sendMessageRequest(&request, (uint8_t*) &m_fileHeader);
+      m_finalHeaderSent = true;
+    }
 
-    if(++m_chunkIndex>=m_fileHeader.chunks_count )
-      finishOrCancelFileTransfer();
+  }
+
+}
 
+void Client::sendFileChunk(uint32_t chunkIndex)
+{
+  message_hdr_t request;
+  uint16_t dataSize;
+
+  // points into the mapped file, or the read-ahead buffer. a stream chunk is
+  // copied, the producer may wrap around over it once it is answered
+  const uint8_t* chunkData;
+  if(m_stream != NULL)
+    chunkData = m_stream->chunk(chunkIndex, m_streamChunk, &dataSize) ? m_streamChunk : NULL;
+  else
+    chunkData = m_chunkSource.chunk(chunkIndex, &dataSize);
+  if(chunkData == NULL)
+  {
+    emit log(QString("Could not read chunk %1.").arg(chunkIndex));
+    finishOrCancelFileTransfer(REQUEST_REJECTED);
+    return;
   }
 
+  request.data_length = sizeof(chunkIndex) + dataSize;
+  request.msg_type = MESSAGE_FILECHUNK;
+  request.is_response = 0;
+  //emit log(QString("Send chunk: %1 .").arg(chunkIndex));
+  int msg_id = sendMessageRequest(&request, (uint8_t*) &chunkIndex, sizeof(chunkIndex), chunkData);
+  if(msg_id == -1)
+    return;
 
+  PendingRequest& pending = m_pendingRequests[msg_id];
+  pending.chunkId = chunkIndex;
+  pending.retries = m_chunkRetries.value(chunkIndex, 0);
+  pending.deadline = requestDeadline(request.data_length, pending.retries);
+  armTimer(&pending.timer, pending.deadline - m_clock.elapsed());
+  m_chunksInFlight++;
+}
 
+/*
+ * queues a chunk to be sent again, because it timed out or
+ * the device answered it with an error.
+ * gives up the whole transfer after MAX_CHUNK_RETRIES, failing with the last cause
+*/
+void Client::retransmitFileChunk(uint32_t chunkIndex, int retries, RequestError cause)
+{
+  if(retries > MAX_CHUNK_RETRIES)
+  {
+    emit log(QString("Chunk %1 failed %2 times.").arg(chunkIndex).arg(retries));
+    finishOrCancelFileTransfer(cause);
+    return;
+  }
 
+  m_chunkRetries[chunkIndex] = retries;
+  m_retransmitChunks.append(chunkIndex);
+  emit chunkRetransmitted(chunkIndex, retries);
 }
 
-void Client::processMessageResponse(message_hdr_t* message)
+void Client::processMessageResponse(message_hdr_t* message, uint8_t* data)
 {
 
   switch(message->msg_type){
     case MESSAGE_HANDSHAKE:
+      processHandshakeResponse(message, data);
       break;
     case MESSAGE_INFO_STATUS:
-      processInfoStatusResponse(message);
+      processInfoStatusResponse(message, data);
       break;
     case MESSAGE_COMMAND:
-      emit sendCommandResponse( * messageData(message) == STATUS_OK );
+      emit sendCommandResponse( * data == STATUS_OK );
       break;
     case MESSAGE_FILEHEADER:
-      if(* messageData(message) == STATUS_OK )
+      if(* data == STATUS_OK )
       {
+        if(m_finalHeaderSent)
+        {
+          // the device has the whole stream
+          finishOrCancelFileTransfer(REQUEST_OK);
+          break;
+        }
         m_fileHeaderAcepted = true;
         emit sendFileHeaderResponse(true);
       }
+      else if(* data == STATUS_ALREADY_STORED)
+      {
+        // nothing to send, see Deduplication in protocol.h
+        emit log(QString("The device already stores %1, no chunks sent.")
+                 .arg(QString::fromLatin1(m_fileHeader.filename, qstrnlen(m_fileHeader.filename, 8))));
+        emit sendFileHeaderResponse(true);
+        finishOrCancelFileTransfer(REQUEST_OK);
+      }
       else
       {
-        finishOrCancelFileTransfer();
+        finishOrCancelFileTransfer(REQUEST_REJECTED);
         emit sendFileHeaderResponse(false );
       }
 
@@ -347,7 +1035,7 @@ void Client::processMessageResponse(message_hdr_t* message)
       break;
 
     case MESSAGE_FILECHUNK:
-      processSendFileChunkResponse(message);
+      processSendFileChunkResponse(message, data);
       break;
   }
 
@@ -355,41 +1043,85 @@ void Client::processMessageResponse(message_hdr_t* message)
 
 }
 
-void Client::processInfoStatusResponse(message_hdr_t* response)
+void Client::processHandshakeResponse(message_hdr_t* response, uint8_t* data)
+{
+  // a bodyless response comes from a legacy device: XOR checksum, SOF/EOF framing
+  integrity_mode_t integrity = INTEGRITY_XOR;
+  framing_mode_t framing = FRAMING_SOF_EOF;
+  int window = 0;
+
+  if(response->data_length >= sizeof(handshake_data_t))
+  {
+    handshake_data_t* handshake = (handshake_data_t*) data; // bytes only
+    if(handshake->integrity < INTEGRITY_MAX_VALID_MODE)
+      integrity = (integrity_mode_t) handshake->integrity;
+    if(handshake->framing < FRAMING_MAX_VALID_MODE)
+      framing = (framing_mode_t) handshake->framing;
+    window = handshake->window;
+    m_heartbeatEnabled = (handshake->features & FEATURE_HEARTBEAT) != 0;
+    m_streamingEnabled.store((handshake->features & FEATURE_STREAMING) != 0);
+    m_dedupEnabled = (handshake->features & FEATURE_DEDUP) != 0;
+  }
+  else
+  {
+    m_heartbeatEnabled = false;
+    m_streamingEnabled.store(0);
+    m_dedupEnabled = false;
+  }
+
+  // without a window ids stay below LEGACY_MSG_WINDOW, with one all of them are used
+  if(window == 0 && m_msgIds.idSpace() != LEGACY_MSG_WINDOW)
+    m_msgIds.configure(LEGACY_MSG_WINDOW, LEGACY_MSG_WINDOW);
+  else if(window > 0 && (window != m_msgIds.window() || m_msgIds.idSpace() != MsgIdAllocator::MAX_IDS))
+  {
+    emit log(QString("Requests in flight: %1").arg(window));
+    m_msgIds.configure(MsgIdAllocator::MAX_IDS, window);
+  }
+
+  if(integrity != m_rxContext.integrity_mode || framing != m_rxContext.framing_mode)
+  {
+    // the device already switched after sending this response
+    emit log(QString("Integrity check mode: %1, framing mode: %2").arg(integrity).arg(framing));
+    protocolCtxSetModes(&m_rxContext, integrity, framing);
+  }
+}
+
+void Client::processInfoStatusResponse(message_hdr_t* response, uint8_t* data)
 {
+  m_fileList.clear();
 
   // first check: data_length must be at least sizeof(status_data_t)
   if(response->data_length < sizeof(status_hdr_t)){
     emit log("Message too short.");
-    emit infoStatusResponse(false,NULL,NULL);
+    emit infoStatusResponse(false, m_deviceStatus, QStringList());
     return;
   }
 
   for(uint8_t i = 0; i < sizeof(status_hdr_t) ; i++)
-    *( (uint8_t*) m_deviceStatus + i)  = * ( messageData(response) + i );
+    *( (uint8_t*) &m_deviceStatus + i)  = * ( data + i );
 
 
-  if(m_deviceStatus->files_count>32){
+  if(m_deviceStatus.files_count>32){
     emit log("Too many files detected.");
-    emit infoStatusResponse(false,NULL,NULL);
+    emit infoStatusResponse(false, m_deviceStatus, QStringList());
     return;
   }
 
 
-  if(response->data_length != sizeof(status_hdr_t) + m_deviceStatus->files_count * 8 ){
+  if(response->data_length != sizeof(status_hdr_t) + m_deviceStatus.files_count * 8 ){
     emit log("Data length mismatch.");
-    emit infoStatusResponse(false,NULL,NULL);
+    emit infoStatusResponse(false, m_deviceStatus, QStringList());
     return;
   }
 
-  for(int i = 0; i<m_deviceStatus->files_count;i++)
+  for(int i = 0; i<m_deviceStatus.files_count;i++)
   {
     QString filename;
     char* filnamePtr;
 
-    filnamePtr = (char*) ( messageData(response) + sizeof(status_hdr_t) + 8 * i );
+    filnamePtr = (char*) ( data + sizeof(status_hdr_t) + 8 * i );
     filename = QString::fromLatin1(filnamePtr ,8);
-    m_fileList->append(filename);
+    m_fileList.append(filename);
 
   }
 
@@ -397,23 +1129,83 @@ void Client::processInfoStatusResponse(message_hdr_t* response)
 
 }
 
-void Client::processSendFileChunkResponse(message_hdr_t* response)
+void Client::processSendFileChunkResponse(message_hdr_t* response, uint8_t* payload)
 {
   //todo: create a list for a send/recieved match
   filechunk_hdr_t data;
-  data = *(filechunk_hdr_t*) messageData(response);
-  emit sendFileChunkResponse((data.status ==0),data.chunk_id, m_fileHeader.chunks_count);
+  memcpy(&data, payload, sizeof(data));
+  emit sendFileChunkResponse((data.status ==0),data.chunk_id, transferChunksCount());
+
+  if(!isTransferring())
+    // transfer was already cancelled
+    return;
+
+  if(m_chunksInFlight > 0)
+    m_chunksInFlight--;
+
+  if(data.status != 0)
+  {
+    retransmitFileChunk(data.chunk_id, m_chunkRetries.value(data.chunk_id, 0) + 1, REQUEST_REJECTED);
+    return;
+  }
+
+  m_chunkRetries.remove(data.chunk_id);
+  m_chunksAcked++;
+  emit sendFileProgress(m_chunksAcked, transferChunksCount());
+
+  if(m_stream != NULL)
+  {
+    // it ends with the final header, not with its last chunk
+    streamChunkAcked(data.chunk_id);
+    return;
+  }
+
+  // chunks may be acknowledged out of order
+  // so the transfer is only done when all of them were
+  if(m_chunksAcked >= m_fileHeader.chunks_count)
+    finishOrCancelFileTransfer(REQUEST_OK);
 
 }
 
+/*
+ * called only when nothing was received for the idle probe interval.
+ * until the device is detected the probe is a handshake, which also negotiates the modes
+*/
 void Client::keepAlive()
 {
 
   if (!m_serialPort->isOpen())
     return;
 
-  sendHandshakeRequest();
+  if(m_deviceConnected == 1 && m_heartbeatEnabled)
+    sendHeartbeat(false);
+  else
+    sendHandshakeRequest();
+
+}
+
+void Client::sendHeartbeat(bool isResponse)
+{
+  message_hdr_t message;
+
+  message.data_length = 0;
+  message.msg_id = 0; // heartbeats take no msg id
+  message.is_response = isResponse;
+  message.msg_type = MESSAGE_HEARTBEAT;
+  sendMessage(&message, NULL);
+}
+
+void Client::setIdleProbeInterval(int milliseconds)
+{
+  if(QThread::currentThread() != thread())
+  {
+    QMetaObject::invokeMethod(this, "setIdleProbeInterval", Qt::QueuedConnection, Q_ARG(int, milliseconds));
+    return;
+  }
 
+  // at least two probes before the device is declared lost
+  m_idleProbeInterval = qBound(100, milliseconds, LINK_MAX_IDLE_PROBE_MS);
+  armTimer(&m_idleProbeTimer, m_idleProbeInterval);
 }
 
 
@@ -423,12 +1215,94 @@ void Client::deadLine()
 }
 
 
+/*
+ * runs every timer of m_timers that expired since the last tick.
+ * a timer may be armed or cancelled by what an earlier one does
+*/
+void Client::processTimers()
+{
+  TimerWheel::Timer* timer;
+  bool requestsTimedOut = false;
+
+  while((timer = m_timers.expire(m_clock.elapsed())) != NULL)
+  {
+    switch(timer->tag)
+    {
+    case TIMER_IDLE_PROBE:
+      armTimer(timer, m_idleProbeInterval);
+      keepAlive();
+      break;
+    case TIMER_DEAD_LINK:
+      deadLine();
+      break;
+    case TIMER_FILE_SEND:
+      armTimer(timer, FILE_SEND_INTERVAL_MS);
+      processFileSend();
+      break;
+    case TIMER_REQUEST:
+      requestTimedOut(timer->id);
+      requestsTimedOut = true;
+      break;
+    }
+  }
+
+  if(requestsTimedOut)
+  {
+    processRequestQueue();
+    if(m_ackClocked && isTransferring())
+      processFileSend();
+  }
+
+  if(m_timers.isEmpty())
+    m_tickTimer->stop();
+}
+
+/*
+ * releases the msg_id of a request whose response is overdue,
+ * so one lost response does not hold it until the device is declared dead.
+ * only the chunks that timed out are sent again.
+*/
+void Client::requestTimedOut(int msgId)
+{
+  PendingRequest& pending = m_pendingRequests[msgId];
+
+  if(!m_msgIds.isUsed(msgId))
+    return;
+
+  releaseMsgId(msgId);
+  emit log(QString("Request timeout: id %1 type %2.").arg(msgId).arg(pending.msgType));
+
+  if(pending.hasReply)
+  {
+    pending.hasReply = false;
+    resolveReply(pending.reply, REQUEST_TIMEOUT);
+  }
+
+  if(!isTransferring())
+    return;
+
+  if(pending.msgType == MESSAGE_FILECHUNK)
+  {
+    if(m_chunksInFlight > 0)
+      m_chunksInFlight--;
+    retransmitFileChunk(pending.chunkId, pending.retries + 1, REQUEST_TIMEOUT);
+  }
+  else if(pending.msgType == MESSAGE_FILEHEADER && !m_fileHeaderAcepted)
+  {
+    m_fileHeaderSent = false; // send it again
+  }
+  else if(pending.msgType == MESSAGE_FILEHEADER && m_finalHeaderSent)
+  {
+    m_finalHeaderSent = false; // the final one, send it again
+  }
+}
+
 void Client::updateDeviceStatus(bool connected)
 {
   //emit log(QString("updateDeviceStatus: %1 %2 %3").arg(m_deviceConnected).arg(connected).arg(m_deviceConnected == (int) connected));
 
   if(connected)
-    m_deadLineTimer->start(); // device responded, so restart timer. This must be called every time.
+    armTimer(&m_deadLineTimer, DEAD_LINK_MS); // device responded, so restart timer. This must be called every time.
 
 
   // m_deviceConnected isnt bool because I need tristate: true, false, not_checked_yet
@@ -443,24 +1317,100 @@ void Client::updateDeviceStatus(bool connected)
 
 
   if(!connected){
-    m_deadLineTimer->stop();
-    m_pendingMessagesMask.fill(false);
-    finishOrCancelFileTransfer();
-    messagesBufferClear();
+    m_timers.cancel(&m_deadLineTimer);
+    m_heartbeatEnabled = false;
+    m_streamingEnabled.store(0);
+    m_dedupEnabled = false;
+    for(int i = 0; i < MsgIdAllocator::MAX_IDS; i++)
+      m_timers.cancel(&m_pendingRequests[i].timer);
+    m_msgIds.releaseAll();
+    for(int i = 0; i < LANE_COUNT; i++)
+      m_laneInFlight[i] = 0;
+    m_msgIds.configure(LEGACY_MSG_WINDOW, LEGACY_MSG_WINDOW);
+    finishOrCancelFileTransfer(REQUEST_DISCONNECTED);
+    failRequests(REQUEST_DISCONNECTED);
+    messagesBufferClearCtx(&m_rxContext);
+    // the device goes back to legacy modes too when it stops hearing from us
+    protocolCtxSetModes(&m_rxContext, INTEGRITY_XOR, FRAMING_SOF_EOF);
+  }
+  else
+  {
+    // send what was requested before the device was detected
+    processRequestQueue();
+    if(m_ackClocked && isTransferring())
+      processFileSend();
   }
 
   emit deviceStatusChanged(connected);
 
 }
 
-void Client::finishOrCancelFileTransfer()
+void Client::finishOrCancelFileTransfer(RequestError error)
 {
-  m_fileSendTimer->stop();
-  if(m_audioFile != NULL && m_audioFile->exists()){
-    m_audioFile->remove();
+  m_timers.cancel(&m_fileSendTimer);
+
+  if(!isTransferring())
+    return;
+
+  if(m_stream != NULL)
+  {
+    // not ours, the producer only learns it has to stop.
+    // done before the reply, which lets the caller delete it
+    disconnect(m_stream, 0, this, 0);
+    if(error != REQUEST_OK)
+      m_stream->abort();
+    m_stream = NULL;
+    m_streamAcked.clear();
+  }
+  else
+  {
+    // not ours either: it may be a cache entry, uploaded again later
+    m_chunkSource.close();
     m_audioFile = NULL;
   }
 
+  if(m_hasFileReply)
+  {
+    m_hasFileReply = false;
+    resolveReply(m_fileReply, error);
+  }
+  m_chunksInFlight = 0;
+  m_retransmitChunks.clear();
+  m_chunkRetries.clear();
+
+  emit sendFileFinished(error == REQUEST_OK);
+
+  // start the next queued upload, if any
+  QMetaObject::invokeMethod(this, "processRequestQueue", Qt::QueuedConnection);
+
+}
+
+bool Client::isTransferring() const
+{
+  return m_audioFile != NULL || m_stream != NULL;
+}
+
+/*
+ * a stream only knows its chunks so far
+*/
+uint32_t Client::transferChunksCount() const
+{
+  return m_stream != NULL ? m_stream->chunksCount() : m_fileHeader.chunks_count;
+}
+
+/*
+ * chunks are answered out of order, the stream ring is released
+ * up to the first one that was not answered yet
+*/
+void Client::streamChunkAcked(uint32_t chunkIndex)
+{
+  if(chunkIndex < m_streamReleased)
+    return;
+
+  m_streamAcked.insert(chunkIndex);
+  while(m_streamAcked.remove(m_streamReleased))
+    m_streamReleased++;
+  m_stream->release(m_streamReleased);
 }
 
 
@@ -487,12 +1437,11 @@ void Client::finishOrCancelFileTransfer()
  *
 */
 
-void Client::processMessageRequest(message_hdr_t *message)
+void Client::processMessageRequest(message_hdr_t *message, uint8_t* data)
 {
   switch(message->msg_type){
     case MESSAGE_HANDSHAKE:
-      message->is_response = 1;
-      sendMessageResponse(message, NULL);
+      sendFakeHandshakeResponse(message, data);
       break;
     case MESSAGE_INFO_STATUS:
       sendFakeDeviceStatus(message);
@@ -504,7 +1453,10 @@ void Client::processMessageRequest(message_hdr_t *message)
       sendStatusResponse(message,STATUS_OK);
       break;
     case MESSAGE_FILECHUNK:
-      sendFakeChunkResponse(message);
+      sendFakeChunkResponse(message, data);
+      break;
+    case MESSAGE_HEARTBEAT:
+      sendHeartbeat(true);
       break;
   }
 
@@ -513,6 +1465,43 @@ void Client::processMessageRequest(message_hdr_t *message)
 
 
 
+void Client::sendFakeHandshakeResponse(message_hdr_t *request, uint8_t* data)
+{
+  message_hdr_t response;
+  handshake_data_t handshake;
+  uint8_t supported = 0;
+  uint8_t framings = 0;
+
+  if(request->data_length >= sizeof(handshake_data_t))
+  {
+    supported = ((handshake_data_t*) data)->integrity;
+    framings = ((handshake_data_t*) data)->framing;
+  }
+
+  // pick the strongest check both sides support
+  memset(&handshake, 0, sizeof(handshake));
+  if(supported & INTEGRITY_FLAG(INTEGRITY_CRC32))
+    handshake.integrity = INTEGRITY_CRC32;
+  else if(supported & INTEGRITY_FLAG(INTEGRITY_CRC16))
+    handshake.integrity = INTEGRITY_CRC16;
+  else
+    handshake.integrity = INTEGRITY_XOR;
+
+  handshake.framing = (framings & FRAMING_FLAG(FRAMING_COBS)) ? FRAMING_COBS : FRAMING_SOF_EOF;
+  // the fake device accepts whatever window and features are asked for
+  if(request->data_length >= sizeof(handshake_data_t))
+  {
+    handshake.window = ((handshake_data_t*) data)->window;
+    handshake.features = ((handshake_data_t*) data)->features & (FEATURE_HEARTBEAT | FEATURE_STREAMING);
+  }
+
+  response.msg_id = request->msg_id;
+  response.msg_type = request->msg_type;
+  response.is_response = 1;
+  response.data_length = sizeof(handshake);
+  sendMessageResponse(&response, (uint8_t*) &handshake);
+}
+
 void Client::sendStatusResponse(message_hdr_t* request, status_id_t status)
 {
   message_hdr_t response;
@@ -557,12 +1546,12 @@ void Client::sendFakeDeviceStatus(message_hdr_t *request)
 
 }
 
-void Client::sendFakeChunkResponse(message_hdr_t *request)
+void Client::sendFakeChunkResponse(message_hdr_t *request, uint8_t* payload)
 {
   message_hdr_t response;
   filechunk_hdr_t data;
   data.status = 0;
-  data.chunk_id = *(uint32_t*) messageData(request);
+  memcpy(&data.chunk_id, payload, sizeof(data.chunk_id));
 
   QByteArray ba;
 
@@ -3,13 +3,46 @@
 
 #include <QObject>
 #include <QByteArray>
-#include <QBitArray>
 #include <QList>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QHash>
+#include <QSet>
 #include <QFile>
 #include <QFileInfo>
+#include <QStringList>
+#include <QThread>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QFuture>
+#include <QFutureInterface>
 #include <QtSerialPort/QSerialPort>
 #include "protocol.h"
+#include "chunksource.h"
+#include "streamchunksource.h"
+#include "msgidallocator.h"
+#include "timerwheel.h"
+
+// passed by value in queued signals, the client runs on its own thread
+Q_DECLARE_METATYPE(status_hdr_t)
+Q_DECLARE_METATYPE(command_type_t)
+
+// how an async request ended
+enum RequestError
+{
+  REQUEST_OK,
+  REQUEST_TIMEOUT,      // no response in time (a chunk, after all its retries)
+  REQUEST_REJECTED,     // the device answered with an error status
+  REQUEST_QUEUE_FULL,   // too many requests were already waiting to be sent
+  REQUEST_DISCONNECTED, // port closed or device lost before the response
+};
+
+struct RequestReply
+{
+  RequestError error;
+  QByteArray data; // response data, empty for file uploads
+};
 
 
 class Client : public QObject
@@ -20,70 +53,262 @@ public:
   explicit Client(QObject *parent = 0);
   ~Client();
 
-  QSerialPort *getSerialPort(void);
+  /*
+   * The client is meant to live on its own I/O thread (see MainWindow).
+   * The methods below can be called from any thread: when the caller is not
+   * on the client thread they are queued to it. openSerialPort and
+   * closeSerialPort block until done, the rest return at once.
+  */
+
+  bool isSerialPortOpen() const;
+
+  Q_INVOKABLE bool openSerialPort(QString port, qint32 baudRate);
+
+  Q_INVOKABLE void closeSerialPort(void);
+
+  Q_INVOKABLE void sendHandshakeRequest();
+
+  /*
+   * Async requests. Each one waits in a queue until a msg id is free (a file
+   * until the previous upload ends) and its future gets a single RequestReply
+   * when the response with its msg id arrives, or when it fails.
+   * The broadcast signals below are still emitted for every response.
+  */
+
+  QFuture<RequestReply> sendCommandAsync(command_type_t command);
+
+  QFuture<RequestReply> getDeviceStatusAsync();
 
-  bool openSerialPort(QString port, uint16_t baudRate);
+  // file must be open and outlive the upload, it is left as it is afterwards.
+  // contentHash is contentHashUpdate of its data, 0 if not known (see Deduplication
+  // in protocol.h): computed where the file is written, not on this thread
+  QFuture<RequestReply> sendFileAsync(QFile *file, uint32_t sampleRate, QString filename, quint64 contentHash = 0);
 
-  void closeSerialPort(void);
+  /*
+   * uploads a file while it is still being written into stream (see Streaming
+   * uploads in protocol.h). the stream is not owned, it must outlive the upload.
+   * fails with REQUEST_REJECTED when the device does not support it, or the
+   * stream is aborted
+  */
+  QFuture<RequestReply> sendStreamAsync(StreamChunkSource* stream, uint32_t sampleRate, QString filename);
 
-  void sendHandshakeRequest();
+  // negotiated in the handshake, false until the device is detected
+  bool isStreamingSupported() const;
 
+  // same as the async ones, for callers that only listen to the signals
   void sendCommandRequest(command_type_t command);
 
   void getDeviceStatus();
 
   void sendFile(QFile *file, uint32_t sampleRate, QString filename);
 
+  Q_INVOKABLE void setFileSendWindow(int window);
+
+  Q_INVOKABLE void setAckClocked(bool ackClocked);
+
+  // how long the link may be silent before a probe is sent
+  Q_INVOKABLE void setIdleProbeInterval(int milliseconds);
+
+  static void encodeFrame(integrity_mode_t integrity, framing_mode_t framing,
+                          message_hdr_t* message, uint8_t* data, QByteArray& frame);
+
+  static int encodeFrame(integrity_mode_t integrity, framing_mode_t framing,
+                         message_hdr_t* message, const uint8_t* prefix, uint16_t prefixLength,
+                         const uint8_t* data, uint8_t* frame);
+
 private:
-  const int MAX_CONCURRENT_MESSAGES = 16;
-  QTimer* m_fileSendTimer;
-  QTimer* m_keepAliveTimer;
-  QTimer* m_deadLineTimer;
+  const int REQUEST_TIMEOUT_MS = 1000;
+  const int MAX_REQUEST_TIMEOUT_MS = 8000;
+  const int MAX_CHUNK_RETRIES = 5;
+  const int MAX_QUEUED_REQUESTS = 64;
+  const int IDLE_PROBE_MS = 1500;
+  const int DEAD_LINK_MS = LINK_DEAD_MS;
+  const int FILE_SEND_INTERVAL_MS = 150; // only used when not ack-clocked
+  // resolution of every deadline below
+  const int TICK_MS = 10;
+  // in-flight slots that only control and liveness requests can take
+  const int RESERVED_CONTROL_SLOTS = 2;
+  const int RESERVED_LIVENESS_SLOTS = 1;
+  // bulk bytes waiting to be written: what a command may have to wait behind
+  const int MAX_BULK_TX_BACKLOG = 2 * MAX_FRAME_LENGTH;
+
+  // requests are scheduled by lane, in this order of priority
+  enum RequestLane
+  {
+    LANE_CONTROL,  // transport commands
+    LANE_LIVENESS, // keep-alive handshakes
+    LANE_STATUS,   // device status
+    LANE_BULK,     // file header and chunks
+    LANE_COUNT,
+  };
+
+  // what each timer in m_timers is for
+  enum TimerTag
+  {
+    TIMER_IDLE_PROBE,
+    TIMER_DEAD_LINK,
+    TIMER_FILE_SEND,
+    TIMER_REQUEST, // id is the msg id
+  };
+
+  // what we remember about a request until its response arrives
+  struct PendingRequest
+  {
+    uint8_t msgType;
+    uint32_t chunkId; // only valid for MESSAGE_FILECHUNK
+    int retries;
+    qint64 deadline; // m_clock time in ms
+    bool hasReply;   // sent by an async request
+    QFutureInterface<RequestReply> reply;
+    RequestLane lane;
+    qint64 queuedAt; // m_clock time the caller asked for it
+    qint64 sentAt;   // m_clock time in us it was sent
+    TimerWheel::Timer timer; // expires at deadline
+  };
+
+  // an async request waiting to be sent
+  struct QueuedRequest
+  {
+    uint8_t msgType;
+    QByteArray data;
+    QFile* file; // MESSAGE_FILEHEADER only
+    StreamChunkSource* stream; // MESSAGE_FILEHEADER of a streaming upload, instead of file
+    QFutureInterface<RequestReply> reply;
+    qint64 queuedAt;
+  };
+
+  QTimer* m_tickTimer; // drives m_timers, only runs while some timer is armed
+  TimerWheel m_timers;
+  TimerWheel::Timer m_idleProbeTimer;
+  TimerWheel::Timer m_deadLineTimer;
+  TimerWheel::Timer m_fileSendTimer;
+  int m_idleProbeInterval;
+  QElapsedTimer m_clock;
 
 
   QFile* m_audioFile;
+  FileChunkSource m_chunkSource;
+  StreamChunkSource* m_stream; // instead of m_audioFile in a streaming upload
+  QAtomicInt m_streamingEnabled; // negotiated in the handshake, read from other threads
+  bool m_finalHeaderSent; // the stream ended and its header went again, with the length
+  uint32_t m_streamReleased; // every chunk before it was answered
+  QSet<uint32_t> m_streamAcked; // chunks answered after m_streamReleased
+  uint8_t m_streamChunk[FILECHUNK_SIZE]; // copied out of the stream ring to be sent
   QSerialPort* m_serialPort;
-  QBitArray m_pendingMessagesMask;
+  QAtomicInt m_serialPortOpen; // read from other threads
+  MsgIdAllocator m_msgIds;
+  // indexed by msg_id. not a QVector: the timers linked in the wheel must not move
+  PendingRequest m_pendingRequests[MsgIdAllocator::MAX_IDS];
+  int m_laneInFlight[LANE_COUNT];
   buffer_status_t m_bufferStatus;
+  protocol_ctx_t m_rxContext;
+  alignas(4) uint8_t m_rxFrame[MAX_MESSAGE_LENGTH]; // for messages wrapping the rx buffer
+  // frames waiting for flushTxBatch: a burst of chunks as acks come in is one write()
+  uint8_t m_txBatch[16 * MAX_FRAME_LENGTH];
+  int m_txBatchLength;
+  bool m_txFlushQueued;
 
-  status_hdr_t* m_deviceStatus;
-  QList<QString>* m_fileList;
+  status_hdr_t m_deviceStatus;
+  QStringList m_fileList;
 
   int m_deviceConnected;
+  bool m_heartbeatEnabled; // negotiated in the handshake
+  bool m_dedupEnabled; // same, content_hash goes in the file headers
   bool m_fileHeaderSent;
   bool m_fileHeaderAcepted;
   fileheader_data_t m_fileHeader;
   uint32_t  m_chunkIndex;
+  uint32_t  m_chunksInFlight;
+  uint32_t  m_chunksAcked;
+  QList<uint32_t> m_retransmitChunks;
+  QHash<uint32_t, int> m_chunkRetries; // only chunks that failed at least once
+  bool m_hasFileReply;
+  QFutureInterface<RequestReply> m_fileReply;
+
+  // filled from any thread, emptied on the client thread
+  QMutex m_requestQueueMutex;
+  QList<QueuedRequest> m_requestQueue[LANE_COUNT];
+  QList<QueuedRequest> m_fileQueue;
+
+  // upload window: how many FILECHUNK requests may be waiting for a response
+  int m_fileSendWindow;
+  // ack-clocked: next chunks are sent as responses arrive (no timer pacing)
+  bool m_ackClocked;
 
-  bool pendingFull();
+  bool canSendMessage(RequestLane lane);
 
-  bool canSendMessage();
+  bool laneHasSlot(RequestLane lane);
+
+  static RequestLane laneOf(uint8_t msgType);
+
+  void releaseMsgId(int msgId);
+
+  void armTimer(TimerWheel::Timer* timer, int milliseconds);
+
+  void requestTimedOut(int msgId);
 
   void sendMessage(message_hdr_t* message, uint8_t* data);
 
-  void sendMessageRequest(message_hdr_t* message, uint8_t* data);
+  void sendMessage(message_hdr_t* message, const uint8_t* prefix, uint16_t prefixLength, const uint8_t* data);
+
+  int sendMessageRequest(message_hdr_t* message, uint8_t* data);
+
+  int sendMessageRequest(message_hdr_t* message, const uint8_t* prefix, uint16_t prefixLength, const uint8_t* data);
+
+  qint64 requestDeadline(uint16_t dataLength, int retries);
+
+  bool pendingRequestMatches(message_hdr_t* response, uint8_t* data);
 
   void sendMessageResponse(message_hdr_t* message, uint8_t* data);
 
-  void processMessageRequest(message_hdr_t *message);
+  void processMessageRequest(message_hdr_t *message, uint8_t* data);
 
-  void processMessageResponse(message_hdr_t *message);
+  void processMessageResponse(message_hdr_t *message, uint8_t* data);
 
   void sendStatusResponse(message_hdr_t *request, status_id_t status);
 
   void sendFakeDeviceStatus(message_hdr_t *request);
 
-  void sendFakeChunkResponse(message_hdr_t *request);
+  void sendFakeChunkResponse(message_hdr_t *request, uint8_t* data);
+
+  void sendFakeHandshakeResponse(message_hdr_t *request, uint8_t* data);
+
+  void sendHeartbeat(bool isResponse);
 
-  void processInfoStatusResponse(message_hdr_t *response);
+  void processHandshakeResponse(message_hdr_t *response, uint8_t* data);
 
-  void processSendFileChunkResponse(message_hdr_t *response);
+  void processInfoStatusResponse(message_hdr_t *response, uint8_t* data);
+
+  void processSendFileChunkResponse(message_hdr_t *response, uint8_t* data);
 
   void readMessageFromBuffer();
 
+  // message is an aligned copy of the header, data its payload as received
+  // (not aligned, only read it with memcpy or byte by byte)
+  void processMessage(message_hdr_t *message, uint8_t* data);
+
   void updateDeviceStatus(bool connected);
 
-  void finishOrCancelFileTransfer(void);
+  void sendFileChunk(uint32_t chunkIndex);
+
+  void retransmitFileChunk(uint32_t chunkIndex, int retries, RequestError cause);
+
+  void finishOrCancelFileTransfer(RequestError error);
+
+  bool isTransferring() const;
+
+  uint32_t transferChunksCount() const;
+
+  void streamChunkAcked(uint32_t chunkIndex);
+
+  QFuture<RequestReply> queueRequest(QueuedRequest& request);
+
+  void startFileTransfer(QueuedRequest& request);
+
+  void failRequests(RequestError error);
+
+  static void resolveReply(QFutureInterface<RequestReply>& reply, RequestError error,
+                           QByteArray data = QByteArray());
 
 
 private slots:
@@ -95,12 +320,24 @@ private slots:
 
   void deadLine();
 
+  void processTimers();
+
+  void flushTxBatch();
+
+  void handleSerialError(QSerialPort::SerialPortError error);
+
+  void processRequestQueue();
+
+  void handleBytesWritten();
+
+  void handleStreamData();
+
 
 signals:
 
   void deviceStatusChanged(bool connected);
 
-  void infoStatusResponse(bool success, status_hdr_t* deviceStatus,  QList<QString>* fileList);
+  void infoStatusResponse(bool success, status_hdr_t deviceStatus, QStringList fileList);
 
   void sendCommandResponse(bool success);
 
@@ -108,8 +345,22 @@ signals:
 
   void sendFileChunkResponse(bool success, uint32_t chunk_id, uint32_t chunksCount);
 
+  void sendFileProgress(uint32_t chunksAcked, uint32_t chunksCount);
+
+  void sendFileFinished(bool success);
+
+  // from the time a command was requested to its response
+  void commandLatency(qint64 milliseconds);
+
+  // from the time a chunk was sent to its response
+  void chunkRoundTrip(qint64 microseconds);
+
+  void chunkRetransmitted(uint32_t chunkId, int retries);
+
   void log(QString message);
 
+  void serialError(QString errorString);
+
 
 
 
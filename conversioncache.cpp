@@ -0,0 +1,159 @@
+#include "conversioncache.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QMutexLocker>
+#include <QCryptographicHash>
+
+ConversionCache::ConversionCache(QString directory, qint64 maxSize)
+{
+  m_directory = directory;
+  m_maxSize = maxSize;
+  m_valid = QDir().mkpath(directory);
+
+  // conversions interrupted by a crash. the recent ones may be running in
+  // another instance of the program, sharing the directory
+  if(m_valid)
+  {
+    QDir dir(directory);
+    QDateTime stale = QDateTime::currentDateTime().addSecs(-STALE_PART_SECS);
+    foreach(const QFileInfo& part, dir.entryInfoList(QStringList("*.part"), QDir::Files))
+      if(part.lastModified() < stale)
+        dir.remove(part.fileName());
+  }
+}
+
+bool ConversionCache::isValid() const
+{
+  return m_valid;
+}
+
+QString ConversionCache::directory() const
+{
+  return m_directory;
+}
+
+/*
+ * MD5 only tells files apart here, and keeps up with the disk
+*/
+QString ConversionCache::key(QString source, int sampleRate)
+{
+  QFile file(source);
+  QCryptographicHash hash(QCryptographicHash::Md5);
+
+  if(!file.open(QIODevice::ReadOnly))
+    return QString();
+
+  while(!file.atEnd())
+  {
+    QByteArray block = file.read(HASH_BLOCK_SIZE);
+    if(block.isEmpty())
+      return QString(); // read error
+    hash.addData(block);
+  }
+
+  return QString("%1-%2-u8-v%3").arg(QString(hash.result().toHex())).arg(sampleRate).arg(FORMAT_VERSION);
+}
+
+QString ConversionCache::acquire(QString key, quint64* contentHash)
+{
+  QMutexLocker locker(&m_mutex);
+  QString path = entryPath(key);
+
+  if(!m_valid || !QFile::exists(path))
+    return QString();
+
+  m_inUse[key]++;
+  touch(path);
+  *contentHash = readHash(key);
+  return path;
+}
+
+QString ConversionCache::insert(QString key, QString path, quint64 contentHash)
+{
+  QMutexLocker locker(&m_mutex);
+  QString entry = entryPath(key);
+
+  if(!m_valid)
+    return QString();
+
+  // converted twice at once, the other one got here first
+  if(QFile::exists(entry))
+    QFile::remove(path);
+  else if(!QFile::rename(path, entry))
+    return QString();
+
+  // without it the entry is still good, only not deduplicated
+  QFile hash(hashPath(key));
+  if(contentHash != 0 && hash.open(QIODevice::WriteOnly))
+    hash.write(QByteArray::number(contentHash, 16));
+
+  m_inUse[key]++;
+  touch(entry);
+  evict();
+  return entry;
+}
+
+void ConversionCache::release(QString key)
+{
+  QMutexLocker locker(&m_mutex);
+
+  if(--m_inUse[key] <= 0)
+    m_inUse.remove(key);
+  evict();
+}
+
+QString ConversionCache::entryPath(QString key) const
+{
+  return m_directory + "/" + key + ".pcm";
+}
+
+QString ConversionCache::hashPath(QString key) const
+{
+  return m_directory + "/" + key + ".hash";
+}
+
+quint64 ConversionCache::readHash(QString key) const
+{
+  QFile hash(hashPath(key));
+
+  if(!hash.open(QIODevice::ReadOnly))
+    return 0;
+  return hash.readAll().toULongLong(NULL, 16);
+}
+
+/*
+ * the modification time tells how recently an entry was used
+*/
+void ConversionCache::touch(QString path)
+{
+  QFile file(path);
+
+  if(file.open(QIODevice::ReadWrite))
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+}
+
+/*
+ * least recently used first, until it fits. called with m_mutex locked
+*/
+void ConversionCache::evict()
+{
+  QDir dir(m_directory);
+  QFileInfoList entries = dir.entryInfoList(QStringList("*.pcm"), QDir::Files, QDir::Time | QDir::Reversed);
+  qint64 total = 0;
+
+  foreach(const QFileInfo& entry, entries)
+    total += entry.size();
+
+  for(int i = 0; i < entries.size() && total > m_maxSize; i++)
+  {
+    if(m_inUse.contains(entries[i].completeBaseName()))
+      continue;
+    if(dir.remove(entries[i].fileName()))
+    {
+      total -= entries[i].size();
+      dir.remove(entries[i].completeBaseName() + ".hash");
+    }
+  }
+}
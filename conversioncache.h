@@ -0,0 +1,66 @@
+#ifndef CONVERSIONCACHE_H
+#define CONVERSIONCACHE_H
+
+#include <QString>
+#include <QHash>
+#include <QMutex>
+
+/*
+ * Converted audio kept on disk, so uploading the same file again (to another
+ * device, or after a failed transfer) skips the conversion.
+ * Entries are named after a hash of the source content, the sample rate and
+ * the output format, so a renamed file still hits and an edited one misses.
+ * They hold the headless pcm_u8 the device plays, ready to be memory mapped
+ * by FileChunkSource, next to a .hash file with its content hash (see
+ * Deduplication in protocol.h), so a hit needs no reading either.
+ * Once the total goes over the size limit the least recently used entries
+ * are removed, except those in use. It can be used from several threads.
+*/
+class ConversionCache
+{
+public:
+  ConversionCache(QString directory, qint64 maxSize);
+
+  // false if the directory can not be created, nothing is cached then
+  bool isValid() const;
+
+  QString directory() const;
+
+  // reads the whole source. empty if it can not be read
+  static QString key(QString source, int sampleRate);
+
+  // the path of the entry, empty if there is none, and its content hash (0 if unknown).
+  // an entry found is in use, and never removed, until release()
+  QString acquire(QString key, quint64* contentHash);
+
+  // moves the finished conversion at path into the cache, in use until release().
+  // returns the path of the entry, empty if it could not be moved
+  QString insert(QString key, QString path, quint64 contentHash);
+
+  void release(QString key);
+
+private:
+  // changes whenever AudioConverter output does, so old entries miss
+  static const int FORMAT_VERSION = 1;
+  static const qint64 HASH_BLOCK_SIZE = 1 << 20;
+  // a .part file not written for this long was left by a crash
+  static const int STALE_PART_SECS = 3600;
+
+  QMutex m_mutex;
+  QString m_directory;
+  qint64 m_maxSize;
+  bool m_valid;
+  QHash<QString, int> m_inUse; // times acquired, by key
+
+  QString entryPath(QString key) const;
+
+  QString hashPath(QString key) const;
+
+  quint64 readHash(QString key) const;
+
+  void touch(QString path);
+
+  void evict();
+};
+
+#endif // CONVERSIONCACHE_H
@@ -0,0 +1,513 @@
+#include "deviceemulator.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+
+DeviceEmulator::DeviceEmulator(PtyLink* link, SdImage* sd)
+{
+  m_link = link;
+  m_sd = sd;
+  protocolCtxInit(&m_rxContext);
+  m_rxContext.resync_mode = RESYNC_NEXT_SOF;
+  m_latency = 0;
+  m_dropRate = 0;
+  m_window = MAX_MSG_WINDOW;
+  m_lastFrameAt = 0;
+  m_negotiated = false;
+  m_features = 0;
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_uploading = false;
+  m_uploadStored = false;
+  memset(&m_upload, 0, sizeof(m_upload));
+  m_chunksReceived = 0;
+  m_streaming = false;
+  m_streamLength = 0;
+}
+
+void DeviceEmulator::setResponseLatency(int milliseconds)
+{
+  m_latency = (int64_t) milliseconds * 1000000;
+}
+
+void DeviceEmulator::setDropRate(double dropRate, uint64_t seed)
+{
+  m_dropRate = dropRate;
+  m_random.seed(seed);
+}
+
+void DeviceEmulator::setWindow(int window)
+{
+  m_window = window < 0 ? 0 : (window > MAX_MSG_WINDOW ? MAX_MSG_WINDOW : window);
+}
+
+void DeviceEmulator::process(int64_t now)
+{
+  uint8_t data[1024];
+  size_t length;
+
+  while((length = m_link->receive(data, sizeof(data), now)) > 0)
+  {
+    const uint8_t* pending = data;
+
+    // same loop as Client::readSerialData
+    while(length > 0)
+    {
+      size_t pushed = messagesBufferPushBlockCtx(&m_rxContext, pending, length);
+      buffer_status_t status;
+      pending += pushed;
+      length -= pushed;
+
+      do{
+        status = messagesBufferProcessCtx(&m_rxContext);
+        if(status == BUFFER_MSG_OK)
+          readMessageFromBuffer(now);
+        else if(status >= BUFFER_ERROR_SOF_EXPECTED)
+          m_stats.resyncs++;
+      } while(status == BUFFER_MSG_OK || status >= BUFFER_ERROR_SOF_EXPECTED);
+
+      if(pushed == 0 && length > 0)
+        messagesBufferClearCtx(&m_rxContext);
+    }
+  }
+
+  if(m_negotiated && now - m_lastFrameAt >= (int64_t) LINK_RESET_MS * 1000000)
+    resetLink();
+
+  m_link->flush(now);
+}
+
+int64_t DeviceEmulator::nextEvent() const
+{
+  int64_t next = m_link->nextEvent();
+  int64_t reset = m_lastFrameAt + (int64_t) LINK_RESET_MS * 1000000;
+
+  if(m_negotiated && (next < 0 || reset < next))
+    next = reset;
+
+  return next;
+}
+
+bool DeviceEmulator::run(const std::atomic<bool>& running)
+{
+  while(running)
+  {
+    struct pollfd fds;
+    int64_t now = PtyLink::monotonicNanos();
+    int64_t next = nextEvent();
+    // wake up now and then to see if running was cleared
+    int timeout = RUN_POLL_MS;
+
+    if(next >= 0 && next - now < (int64_t) RUN_POLL_MS * 1000000)
+      timeout = next <= now ? 0 : (int) ((next - now + 999999) / 1000000);
+
+    fds.fd = m_link->fd();
+    fds.events = (m_link->canReceive() ? POLLIN : 0) | (m_link->isTxBlocked() ? POLLOUT : 0);
+    fds.revents = 0;
+    if(poll(&fds, 1, timeout) < 0 && errno != EINTR)
+    {
+      perror("poll");
+      return false;
+    }
+
+    process(PtyLink::monotonicNanos());
+  }
+
+  return true;
+}
+
+const DeviceEmulator::Stats& DeviceEmulator::stats() const
+{
+  return m_stats;
+}
+
+void DeviceEmulator::readMessageFromBuffer(int64_t now)
+{
+  uint16_t length;
+  uint8_t* raw_data = messagesBufferPeekCtx(&m_rxContext, &length);
+  bool inPlace = raw_data != NULL;
+  message_hdr_t header;
+
+  if(!inPlace)
+  {
+    // it wraps around the rx buffer
+    length = messagesBufferPopIntoCtx(&m_rxContext, m_rxFrame, sizeof(m_rxFrame));
+    raw_data = m_rxFrame;
+  }
+
+  // a peeked message is not aligned: only its header is copied out
+  if(length >= sizeof(header))
+  {
+    memcpy(&header, raw_data, sizeof(header));
+    processRequest(&header, raw_data + sizeof(header), now);
+  }
+
+  if(inPlace)
+    messagesBufferReleaseCtx(&m_rxContext);
+}
+
+void DeviceEmulator::processRequest(message_hdr_t* request, const uint8_t* data, int64_t now)
+{
+  m_lastFrameAt = now;
+
+  if(request->is_response || request->msg_type >= MESSAGE_MAX_VALID_TYPE)
+    return;
+
+  m_stats.requests++;
+  if(m_dropRate > 0 && m_random.uniform() < m_dropRate)
+  {
+    m_stats.dropped++;
+    return;
+  }
+
+  switch(request->msg_type){
+    case MESSAGE_HANDSHAKE:
+      processHandshake(request, data, now);
+      break;
+    case MESSAGE_INFO_STATUS:
+      processInfoStatus(request, now);
+      break;
+    case MESSAGE_COMMAND:
+      sendStatusResponse(request, STATUS_OK, now);
+      break;
+    case MESSAGE_FILEHEADER:
+      processFileHeader(request, data, now);
+      break;
+    case MESSAGE_FILECHUNK:
+      processFileChunk(request, data, now);
+      break;
+    case MESSAGE_HEARTBEAT:
+      request->msg_id = 0;
+      sendResponse(request, NULL, 0, now);
+      break;
+  }
+}
+
+/*
+ * frames it in the current modes and queues it to leave after the latency
+*/
+void DeviceEmulator::sendResponse(message_hdr_t* request, const uint8_t* data, uint16_t length, int64_t now)
+{
+  message_hdr_t response;
+  integrity_mode_t integrity = m_rxContext.integrity_mode;
+  uint8_t checksumSize = protocolChecksumSize(integrity);
+  uint8_t trailer[MAX_CHECKSUM_SIZE];
+  size_t frameLength;
+
+  response.data_length = length;
+  response.msg_id = request->msg_id;
+  response.msg_full_type = 0;
+  response.msg_type = request->msg_type;
+  response.is_response = 1;
+
+  uint32_t checksum = protocolChecksumInit(integrity);
+  checksum = protocolChecksumUpdate(integrity, checksum, (uint8_t*) &response, sizeof(response));
+  checksum = protocolChecksumUpdate(integrity, checksum, data, length);
+  checksum = protocolChecksumFinal(integrity, checksum);
+  for(uint8_t i = 0; i < checksumSize; i++)
+    trailer[i] = (uint8_t) (checksum >> (8 * i)); // little endian
+
+  if(m_rxContext.framing_mode == FRAMING_COBS)
+  {
+    cobs_encoder_t encoder;
+    cobsEncoderInit(&encoder, m_txFrame);
+    cobsEncoderUpdate(&encoder, (uint8_t*) &response, sizeof(response));
+    cobsEncoderUpdate(&encoder, data, length);
+    cobsEncoderUpdate(&encoder, trailer, checksumSize);
+    frameLength = cobsEncoderFinish(&encoder);
+  }
+  else
+  {
+    frameLength = 0;
+    m_txFrame[frameLength++] = START_OF_FRAME;
+    memcpy(m_txFrame + frameLength, &response, sizeof(response));
+    frameLength += sizeof(response);
+    if(length > 0)
+      memcpy(m_txFrame + frameLength, data, length);
+    frameLength += length;
+    memcpy(m_txFrame + frameLength, trailer, checksumSize);
+    frameLength += checksumSize;
+    m_txFrame[frameLength++] = END_OF_FRAME;
+  }
+
+  m_link->send(m_txFrame, frameLength, now + m_latency);
+}
+
+void DeviceEmulator::sendStatusResponse(message_hdr_t* request, status_id_t status, int64_t now)
+{
+  uint8_t data = status;
+  sendResponse(request, &data, sizeof(data), now);
+}
+
+void DeviceEmulator::processHandshake(message_hdr_t* request, const uint8_t* data, int64_t now)
+{
+  handshake_data_t handshake;
+  handshake_data_t offer;
+
+  memset(&offer, 0, sizeof(offer));
+  if(request->data_length >= sizeof(handshake_data_t))
+    memcpy(&offer, data, sizeof(offer));
+
+  // the strongest check and the framing both sides support
+  memset(&handshake, 0, sizeof(handshake));
+  if(offer.integrity & INTEGRITY_FLAG(INTEGRITY_CRC32))
+    handshake.integrity = INTEGRITY_CRC32;
+  else if(offer.integrity & INTEGRITY_FLAG(INTEGRITY_CRC16))
+    handshake.integrity = INTEGRITY_CRC16;
+  else
+    handshake.integrity = INTEGRITY_XOR;
+  handshake.framing = (offer.framing & FRAMING_FLAG(FRAMING_COBS)) ? FRAMING_COBS : FRAMING_SOF_EOF;
+  handshake.window = offer.window < m_window ? offer.window : m_window;
+  handshake.features = offer.features & (FEATURE_HEARTBEAT | FEATURE_STREAMING | FEATURE_DEDUP);
+  m_features = handshake.features;
+
+  // the response goes in the modes the request came in, then they change
+  sendResponse(request, (uint8_t*) &handshake, sizeof(handshake), now);
+  if(handshake.integrity != m_rxContext.integrity_mode || handshake.framing != m_rxContext.framing_mode)
+  {
+    fprintf(stderr, "link: integrity %d, framing %d, window %d\n",
+            handshake.integrity, handshake.framing, handshake.window);
+    protocolCtxSetModes(&m_rxContext, (integrity_mode_t) handshake.integrity,
+                        (framing_mode_t) handshake.framing);
+  }
+  m_negotiated = true;
+}
+
+void DeviceEmulator::processInfoStatus(message_hdr_t* request, int64_t now)
+{
+  uint8_t data[sizeof(status_hdr_t) + SdImage::MAX_FILES * 8];
+  status_hdr_t status;
+
+  memset(&status, 0, sizeof(status));
+  status.files_count = m_sd->filesCount();
+  status.blocks_count = m_sd->blocksCount();
+  status.last_block = m_sd->lastBlock();
+
+  memcpy(data, &status, sizeof(status));
+  for(int i = 0; i < status.files_count; i++)
+    memcpy(data + sizeof(status) + i * 8, m_sd->file(i).filename, 8);
+
+  sendResponse(request, data, sizeof(status) + status.files_count * 8, now);
+}
+
+/*
+ * a new header drops the upload in progress, if any.
+ * one without length starts a streaming upload, which ends with
+ * its header again (see processFinalHeader).
+ * one of a file already stored is not uploaded (see storeDuplicate)
+*/
+void DeviceEmulator::processFileHeader(message_hdr_t* request, const uint8_t* data, int64_t now)
+{
+  fileheader_data_t header;
+
+  if(request->data_length < sizeof(header))
+  {
+    sendStatusResponse(request, STATUS_ERROR, now);
+    return;
+  }
+  memcpy(&header, data, sizeof(header));
+
+  if(m_streaming && header.length > 0
+     && !memcmp(header.filename, m_upload.filename, sizeof(header.filename))
+     && header.sample_rate == m_upload.sample_rate)
+  {
+    if(m_uploading)
+    {
+      processFinalHeader(request, header, now);
+      return;
+    }
+
+    // the final header again, its response was lost
+    header.block_start = m_upload.block_start;
+    if(m_uploadStored && !memcmp(&header, &m_upload, sizeof(header)))
+    {
+      sendStatusResponse(request, STATUS_OK, now);
+      return;
+    }
+  }
+
+  if(header.length > 0 && (m_features & FEATURE_DEDUP) && storeDuplicate(header))
+  {
+    sendStatusResponse(request, STATUS_ALREADY_STORED, now);
+    return;
+  }
+
+  if(header.length == 0 && header.chunks_count == 0 && (m_features & FEATURE_STREAMING))
+  {
+    // the free blocks after the last file, as many as it takes
+    header.block_start = m_sd->allocate(1);
+    if(header.block_start == 0)
+    {
+      sendStatusResponse(request, STATUS_ERROR, now);
+      return;
+    }
+
+    if(!m_streaming || !m_uploading || memcmp(&header, &m_upload, sizeof(header)) != 0)
+    {
+      m_uploading = true;
+      m_uploadStored = false;
+      m_streaming = true;
+      m_upload = header;
+      m_chunkReceived.clear();
+      m_chunksReceived = 0;
+      m_streamLength = 0;
+    }
+    sendStatusResponse(request, STATUS_OK, now);
+    return;
+  }
+
+  uint32_t chunksCount = (header.length + FILECHUNK_SIZE - 1) / FILECHUNK_SIZE;
+  header.block_start = m_sd->allocate(header.length);
+  if(header.length == 0 || header.chunks_count != chunksCount || header.block_start == 0)
+  {
+    sendStatusResponse(request, STATUS_ERROR, now);
+    return;
+  }
+
+  // a header sent again after its response was lost is the same upload
+  if(!m_uploading || memcmp(&header, &m_upload, sizeof(header)) != 0)
+  {
+    m_uploading = true;
+    m_uploadStored = false;
+    m_streaming = false;
+    m_upload = header;
+    m_chunkReceived.assign(chunksCount, false);
+    m_chunksReceived = 0;
+  }
+
+  sendStatusResponse(request, STATUS_OK, now);
+}
+
+/*
+ * the final header of a streaming upload: the file is stored only if every
+ * chunk up to its length arrived
+*/
+void DeviceEmulator::processFinalHeader(message_hdr_t* request, fileheader_data_t& header, int64_t now)
+{
+  header.block_start = m_upload.block_start;
+
+  uint32_t chunksCount = (header.length + FILECHUNK_SIZE - 1) / FILECHUNK_SIZE;
+  bool complete = m_uploading && header.chunks_count == chunksCount
+      && m_chunkReceived.size() == chunksCount && m_chunksReceived == chunksCount
+      && m_streamLength == header.length;
+
+  m_upload = header;
+  if(complete)
+    storeUpload();
+  else
+    m_uploading = false;
+
+  if(!m_uploadStored)
+    m_streaming = false; // dropped
+  sendStatusResponse(request, m_uploadStored ? STATUS_OK : STATUS_ERROR, now);
+}
+
+void DeviceEmulator::storeUpload()
+{
+  m_uploading = false;
+  if(m_sd->addFile(m_upload))
+  {
+    m_uploadStored = true;
+    m_stats.files++;
+    fprintf(stderr, "stored %.8s: %u bytes, blocks %u to %u\n", m_upload.filename, m_upload.length,
+            m_upload.block_start, m_upload.block_start + SdImage::blocksFor(m_upload.length) - 1);
+  }
+}
+
+/*
+ * true if the audio of header is stored already: under another name
+ * it is listed again, with the blocks of the stored one
+*/
+bool DeviceEmulator::storeDuplicate(fileheader_data_t& header)
+{
+  uint64_t hash = fileheaderContentHash(&header);
+  int same = -1;
+
+  if(hash == 0)
+    return false;
+
+  for(int i = 0; i < m_sd->filesCount(); i++)
+  {
+    const fileheader_data_t& stored = m_sd->file(i);
+    if(fileheaderContentHash(&stored) != hash || stored.length != header.length
+       || stored.sample_rate != header.sample_rate || stored.chunks_count != header.chunks_count)
+      continue;
+
+    // listed under this name already, maybe the response was lost
+    if(!memcmp(stored.filename, header.filename, sizeof(header.filename)))
+      return true;
+    if(same < 0)
+      same = i;
+  }
+
+  if(same < 0)
+    return false;
+
+  const fileheader_data_t& stored = m_sd->file(same);
+  header.block_start = stored.block_start;
+  if(!m_sd->addFile(header))
+    return false;
+  m_stats.duplicates++;
+  fprintf(stderr, "stored %.8s: same audio as %.8s, blocks %u to %u\n", header.filename, stored.filename,
+          header.block_start, header.block_start + SdImage::blocksFor(header.length) - 1);
+  return true;
+}
+
+void DeviceEmulator::processFileChunk(message_hdr_t* request, const uint8_t* data, int64_t now)
+{
+  filechunk_hdr_t response;
+  uint32_t chunkId = 0;
+
+  if(request->data_length >= sizeof(chunkId))
+    memcpy(&chunkId, data, sizeof(chunkId));
+
+  response.status = STATUS_ERROR;
+  response.chunk_id = chunkId;
+
+  uint32_t offset = chunkId * FILECHUNK_SIZE;
+  uint32_t expected = 0;
+  if((m_uploading || m_uploadStored) && chunkId < m_upload.chunks_count)
+    expected = m_upload.length - offset < FILECHUNK_SIZE ? m_upload.length - offset : FILECHUNK_SIZE;
+  else if(m_uploading && m_streaming && request->data_length > sizeof(chunkId)
+          && request->data_length - sizeof(chunkId) <= FILECHUNK_SIZE)
+    expected = request->data_length - sizeof(chunkId); // the length is not known yet
+
+  if(m_streaming && m_uploading && chunkId >= m_chunkReceived.size())
+    m_chunkReceived.resize(chunkId + 1, false);
+
+  if(m_uploadStored && expected > 0)
+  {
+    response.status = STATUS_OK; // already stored, only the response was lost
+  }
+  else if(expected > 0 && request->data_length == sizeof(chunkId) + expected
+          && m_sd->write(m_upload.block_start, offset, data + sizeof(chunkId), expected))
+  {
+    response.status = STATUS_OK;
+    m_stats.chunks++;
+    if(!m_chunkReceived[chunkId])
+    {
+      m_chunkReceived[chunkId] = true;
+      m_chunksReceived++;
+      m_streamLength += expected;
+    }
+  }
+
+  sendResponse(request, (uint8_t*) &response, sizeof(response), now);
+
+  // a stream is only complete at its final header
+  if(m_uploading && !m_streaming && m_chunksReceived == m_upload.chunks_count)
+    storeUpload();
+}
+
+/*
+ * nothing valid heard for a while: maybe the client went back to legacy modes
+*/
+void DeviceEmulator::resetLink()
+{
+  m_negotiated = false;
+  m_features = 0;
+  m_stats.linkResets++;
+  messagesBufferClearCtx(&m_rxContext);
+  protocolCtxSetModes(&m_rxContext, INTEGRITY_XOR, FRAMING_SOF_EOF);
+  fprintf(stderr, "link: reset to legacy modes\n");
+}
@@ -0,0 +1,112 @@
+#ifndef DEVICEEMULATOR_H
+#define DEVICEEMULATOR_H
+
+#include <atomic>
+#include <vector>
+#include "protocol.h"
+#include "ptylink.h"
+#include "sdimage.h"
+
+/*
+ * The device side of the protocol, for testing the client without hardware.
+ * It answers every request like the device firmware: handshakes negotiate the
+ * integrity check, framing, window and features, uploads are stored in the SD
+ * image and listed by status responses.
+ * Responses leave after a fixed latency, and a share of the requests can be
+ * dropped with no response, as if they never arrived.
+*/
+class DeviceEmulator
+{
+public:
+  struct Stats
+  {
+    uint64_t requests;   // valid requests received
+    uint64_t dropped;    // of them, ignored on purpose
+    uint64_t resyncs;    // broken frames
+    uint64_t chunks;     // chunks written, including repeated ones
+    uint64_t files;      // uploads completed
+    uint64_t duplicates; // files added with the audio of a stored one, no chunks sent
+    uint64_t linkResets; // went back to legacy modes
+  };
+
+  DeviceEmulator(PtyLink* link, SdImage* sd);
+
+  void setResponseLatency(int milliseconds);
+
+  void setDropRate(double dropRate, uint64_t seed);
+
+  // window the device accepts, 0 for a legacy device
+  void setWindow(int window);
+
+  // parses what arrived and answers it, times as in PtyLink
+  void process(int64_t now);
+
+  // when process has something to do without new input, -1 if never
+  int64_t nextEvent() const;
+
+  // waits on the pty and processes it until running is cleared.
+  // returns false on a poll error
+  bool run(const std::atomic<bool>& running);
+
+  const Stats& stats() const;
+
+private:
+  // between the longest idle probe interval and the client declaring the
+  // device lost, see Handshaking in protocol.h
+  static const int LINK_RESET_MS = 4000;
+  static_assert(LINK_RESET_MS > LINK_MAX_IDLE_PROBE_MS && LINK_RESET_MS < LINK_DEAD_MS,
+                "the link reset breaks the timing contract");
+  static const int RUN_POLL_MS = 100;
+
+  PtyLink* m_link;
+  SdImage* m_sd;
+  protocol_ctx_t m_rxContext;
+  alignas(4) uint8_t m_rxFrame[MAX_MESSAGE_LENGTH];
+  uint8_t m_txFrame[MAX_FRAME_LENGTH];
+  int64_t m_latency;
+  double m_dropRate;
+  LinkRandom m_random;
+  int m_window;
+  int64_t m_lastFrameAt;
+  bool m_negotiated;
+  uint8_t m_features; // negotiated in the handshake
+  Stats m_stats;
+
+  // upload in progress, or the last one stored: its chunks may come again
+  // when their responses were lost
+  bool m_uploading;
+  bool m_uploadStored;
+  fileheader_data_t m_upload;
+  std::vector<bool> m_chunkReceived;
+  uint32_t m_chunksReceived;
+  // streaming upload: the length comes in the final header
+  bool m_streaming;
+  uint32_t m_streamLength; // bytes in the chunks received
+
+  void readMessageFromBuffer(int64_t now);
+
+  // request is an aligned copy of the header, data the payload in place
+  void processRequest(message_hdr_t* request, const uint8_t* data, int64_t now);
+
+  void sendResponse(message_hdr_t* request, const uint8_t* data, uint16_t length, int64_t now);
+
+  void sendStatusResponse(message_hdr_t* request, status_id_t status, int64_t now);
+
+  void processHandshake(message_hdr_t* request, const uint8_t* data, int64_t now);
+
+  void processInfoStatus(message_hdr_t* request, int64_t now);
+
+  void processFileHeader(message_hdr_t* request, const uint8_t* data, int64_t now);
+
+  void processFinalHeader(message_hdr_t* request, fileheader_data_t& header, int64_t now);
+
+  void storeUpload();
+
+  bool storeDuplicate(fileheader_data_t& header);
+
+  void processFileChunk(message_hdr_t* request, const uint8_t* data, int64_t now);
+
+  void resetLink();
+};
+
+#endif // DEVICEEMULATOR_H
@@ -0,0 +1,27 @@
+# Device emulator over a pseudo-terminal, for testing and benchmarking the client
+# without hardware (Linux only, no Qt needed).
+# Build it on its own: qmake emulator/emulator.pro && make
+# Run ./tpo_info2_emulator --help for options, then open the pty path it prints
+# from the client like any serial port.
+
+QT -= core gui
+TARGET = tpo_info2_emulator
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle qt
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    main.cpp \
+    ptylink.cpp \
+    sdimage.cpp \
+    deviceemulator.cpp \
+    ../protocol.c
+
+HEADERS += \
+    ptylink.h \
+    sdimage.h \
+    deviceemulator.h \
+    ../protocol.h \
+    ../crctables.h
@@ -0,0 +1,104 @@
+#include "deviceemulator.h"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::atomic<bool> running(true);
+
+static void stop(int)
+{
+  running = false;
+}
+
+static void usage(const char* program)
+{
+  printf("usage: %s [options]\n"
+         "  --baud rate      line rate the pty is paced at, 0 for none (default 115200)\n"
+         "  --latency ms     delay before every response leaves (default 0)\n"
+         "  --ber rate       bit error rate, both directions (default 0)\n"
+         "  --drop rate      share of requests ignored (default 0)\n"
+         "  --window n       requests the device accepts in flight, 0 for legacy (default 255)\n"
+         "  --seed n         seed of the errors and drops (default 1)\n"
+         "  --image path     SD image file, kept between runs (default: a temporary one)\n"
+         "  --blocks n       SD image size in 512 byte blocks (default 131072)\n"
+         "  --format         start with an empty SD image\n"
+         "  --link path      symlink to the pty, so the client finds it by a fixed name\n"
+         "The pty path is printed on the first line of stdout, the counters on exit.\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+  int baudRate = 115200;
+  int latency = 0;
+  double bitErrorRate = 0;
+  double dropRate = 0;
+  int window = MAX_MSG_WINDOW;
+  uint64_t seed = 1;
+  const char* imagePath = NULL;
+  uint32_t blocksCount = 131072;
+  bool format = false;
+  const char* linkPath = NULL;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--baud") && i + 1 < argc)
+      baudRate = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--latency") && i + 1 < argc)
+      latency = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--ber") && i + 1 < argc)
+      bitErrorRate = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--drop") && i + 1 < argc)
+      dropRate = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--window") && i + 1 < argc)
+      window = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "--image") && i + 1 < argc)
+      imagePath = argv[++i];
+    else if(!strcmp(argv[i], "--blocks") && i + 1 < argc)
+      blocksCount = strtoul(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "--format"))
+      format = true;
+    else if(!strcmp(argv[i], "--link") && i + 1 < argc)
+      linkPath = argv[++i];
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  SdImage sd;
+  if(!sd.open(imagePath, blocksCount, format))
+    return 1;
+
+  PtyLink link;
+  if(!link.open(linkPath))
+    return 1;
+  link.configure(baudRate, bitErrorRate, seed);
+
+  DeviceEmulator device(&link, &sd);
+  device.setResponseLatency(latency);
+  device.setDropRate(dropRate, seed);
+  device.setWindow(window);
+
+  printf("%s\n", linkPath != NULL ? linkPath : link.slaveName());
+  fflush(stdout);
+  fprintf(stderr, "SD image: %d files, %u of %u blocks used\n",
+          sd.filesCount(), sd.lastBlock(), sd.blocksCount());
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  bool ok = device.run(running);
+
+  const DeviceEmulator::Stats& stats = device.stats();
+  fprintf(stderr, "requests %llu, dropped %llu, resyncs %llu, bit errors %llu, chunks %llu, files %llu, duplicates %llu, link resets %llu\n",
+          (unsigned long long) stats.requests, (unsigned long long) stats.dropped,
+          (unsigned long long) stats.resyncs, (unsigned long long) link.bitErrors(),
+          (unsigned long long) stats.chunks, (unsigned long long) stats.files,
+          (unsigned long long) stats.duplicates, (unsigned long long) stats.linkResets);
+
+  return ok ? 0 : 1;
+}
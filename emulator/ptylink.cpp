@@ -0,0 +1,313 @@
+#include "ptylink.h"
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+LinkRandom::LinkRandom(uint64_t seed)
+{
+  this->seed(seed);
+}
+
+void LinkRandom::seed(uint64_t seed)
+{
+  // xorshift gets stuck on 0
+  m_state = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+uint64_t LinkRandom::next()
+{
+  m_state ^= m_state << 13;
+  m_state ^= m_state >> 7;
+  m_state ^= m_state << 17;
+  return m_state;
+}
+
+double LinkRandom::uniform()
+{
+  return (next() >> 11) * (1.0 / 9007199254740992.0); // 53 bits
+}
+
+PtyLink::PtyLink()
+{
+  m_master = -1;
+  m_slave = -1;
+  m_slaveName[0] = 0;
+  m_symlink[0] = 0;
+  m_bytePeriod = 0;
+  m_bitErrorRate = 0;
+  m_bitErrors = 0;
+  m_rxErrors.bitsToError = 0;
+  m_txErrors.bitsToError = 0;
+  m_rxLineAt = 0;
+  m_txLineAt = 0;
+  m_txBlocked = false;
+}
+
+PtyLink::~PtyLink()
+{
+  close();
+}
+
+bool PtyLink::open(const char* symlinkPath)
+{
+  struct termios tio;
+
+  close();
+
+  m_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(m_master < 0)
+  {
+    perror("posix_openpt");
+    return false;
+  }
+
+  if(grantpt(m_master) != 0 || unlockpt(m_master) != 0 || ptsname(m_master) == NULL)
+  {
+    perror("pty");
+    close();
+    return false;
+  }
+  snprintf(m_slaveName, sizeof(m_slaveName), "%s", ptsname(m_master));
+
+  // raw bytes both ways: no echo, no line editing, no CR/LF translation
+  m_slave = ::open(m_slaveName, O_RDWR | O_NOCTTY);
+  if(m_slave < 0 || tcgetattr(m_slave, &tio) != 0)
+  {
+    perror(m_slaveName);
+    close();
+    return false;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(m_slave, TCSANOW, &tio);
+
+  fcntl(m_master, F_SETFL, fcntl(m_master, F_GETFL) | O_NONBLOCK);
+
+  if(symlinkPath != NULL)
+  {
+    unlink(symlinkPath);
+    if(symlink(m_slaveName, symlinkPath) != 0)
+    {
+      perror(symlinkPath);
+      close();
+      return false;
+    }
+    snprintf(m_symlink, sizeof(m_symlink), "%s", symlinkPath);
+  }
+
+  return true;
+}
+
+void PtyLink::close()
+{
+  if(m_symlink[0] != 0)
+    unlink(m_symlink);
+  if(m_slave >= 0)
+    ::close(m_slave);
+  if(m_master >= 0)
+    ::close(m_master);
+
+  m_master = -1;
+  m_slave = -1;
+  m_slaveName[0] = 0;
+  m_symlink[0] = 0;
+  m_rxLine.clear();
+  m_txQueue.clear();
+  m_txBlocked = false;
+}
+
+const char* PtyLink::slaveName() const
+{
+  return m_slaveName;
+}
+
+int PtyLink::fd() const
+{
+  return m_master;
+}
+
+void PtyLink::configure(int baudRate, double bitErrorRate, uint64_t seed)
+{
+  m_bytePeriod = baudRate > 0 ? 10 * 1000000000LL / baudRate : 0;
+  m_bitErrorRate = bitErrorRate;
+  m_rxErrors.random.seed(seed);
+  m_txErrors.random.seed(seed * 2 + 1);
+  nextBitError(m_rxErrors);
+  nextBitError(m_txErrors);
+}
+
+size_t PtyLink::receive(uint8_t* data, size_t size, int64_t now)
+{
+  uint8_t buffer[1024];
+
+  // take from the pty only what the line may hold, the client blocks on the rest
+  while(m_rxLine.size() < RX_LINE_BUFFER)
+  {
+    size_t wanted = RX_LINE_BUFFER - m_rxLine.size();
+    ssize_t length = read(m_master, buffer, wanted < sizeof(buffer) ? wanted : sizeof(buffer));
+    if(length <= 0)
+      break; // EAGAIN, or EIO while the slave is being reopened
+
+    if(m_rxLine.empty() && m_rxLineAt < now)
+      m_rxLineAt = now; // the line was idle
+    m_rxLine.insert(m_rxLine.end(), buffer, buffer + length);
+  }
+
+  size_t length = lineBudget(m_rxLineAt, now, m_rxLine.size() < size ? m_rxLine.size() : size);
+  for(size_t i = 0; i < length; i++)
+  {
+    data[i] = m_rxLine.front();
+    m_rxLine.pop_front();
+  }
+  corrupt(m_rxErrors, data, length);
+
+  return length;
+}
+
+void PtyLink::send(const uint8_t* data, size_t length, int64_t readyAt)
+{
+  TxFrame frame;
+
+  // a frame can not go out before the one queued ahead of it
+  if(!m_txQueue.empty() && m_txQueue.back().readyAt > readyAt)
+    readyAt = m_txQueue.back().readyAt;
+
+  frame.readyAt = readyAt;
+  frame.data.assign(data, data + length);
+  frame.written = 0;
+  frame.corrupted = 0;
+  m_txQueue.push_back(frame);
+}
+
+void PtyLink::flush(int64_t now)
+{
+  while(!m_txQueue.empty() && m_txQueue.front().readyAt <= now)
+  {
+    TxFrame& frame = m_txQueue.front();
+    int64_t lineAt = m_txLineAt > frame.readyAt ? m_txLineAt : frame.readyAt;
+    size_t length = lineBudget(lineAt, now, frame.data.size() - frame.written);
+
+    if(length == 0)
+      return;
+
+    // bytes the pty does not take now go out later, and are corrupted only once
+    uint8_t* pending = frame.data.data() + frame.written;
+    if(frame.written + length > frame.corrupted)
+    {
+      corrupt(m_txErrors, frame.data.data() + frame.corrupted, frame.written + length - frame.corrupted);
+      frame.corrupted = frame.written + length;
+    }
+
+    ssize_t written = write(m_master, pending, length);
+    m_txBlocked = written < (ssize_t) length;
+    if(written <= 0)
+      return; // the client is not reading, the line waits too
+
+    frame.written += written;
+    m_txLineAt = lineAt - (int64_t) (length - written) * m_bytePeriod;
+    if(frame.written < frame.data.size())
+      return;
+    m_txQueue.pop_front();
+  }
+}
+
+int64_t PtyLink::nextEvent() const
+{
+  int64_t next = -1;
+
+  if(!m_rxLine.empty())
+    next = m_rxLineAt + m_bytePeriod;
+
+  if(!m_txQueue.empty() && !m_txBlocked)
+  {
+    int64_t tx = m_txQueue.front().readyAt;
+    if(tx < m_txLineAt + m_bytePeriod)
+      tx = m_txLineAt + m_bytePeriod;
+    if(next < 0 || tx < next)
+      next = tx;
+  }
+
+  return next;
+}
+
+bool PtyLink::canReceive() const
+{
+  return m_rxLine.size() < RX_LINE_BUFFER;
+}
+
+bool PtyLink::isTxBlocked() const
+{
+  return m_txBlocked;
+}
+
+uint64_t PtyLink::bitErrors() const
+{
+  return m_bitErrors;
+}
+
+int64_t PtyLink::monotonicNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+size_t PtyLink::lineBudget(int64_t& lineAt, int64_t now, size_t wanted) const
+{
+  if(m_bytePeriod == 0)
+  {
+    lineAt = now;
+    return wanted;
+  }
+
+  if(now < lineAt + m_bytePeriod)
+    return 0;
+
+  size_t length = (now - lineAt) / m_bytePeriod;
+  if(length > wanted)
+    length = wanted;
+  lineAt += (int64_t) length * m_bytePeriod;
+
+  return length;
+}
+
+void PtyLink::corrupt(BitErrors& errors, uint8_t* data, size_t length)
+{
+  if(m_bitErrorRate <= 0)
+    return;
+
+  uint64_t bits = (uint64_t) length * 8;
+  uint64_t position = 0;
+
+  // jump from error to error instead of drawing a number per bit
+  while(errors.bitsToError < bits - position)
+  {
+    position += errors.bitsToError;
+    data[position / 8] ^= 1 << (position % 8);
+    m_bitErrors++;
+    position++;
+    nextBitError(errors);
+  }
+  errors.bitsToError -= bits - position;
+}
+
+void PtyLink::nextBitError(BitErrors& errors)
+{
+  if(m_bitErrorRate <= 0)
+    return;
+  if(m_bitErrorRate >= 1)
+  {
+    errors.bitsToError = 0;
+    return;
+  }
+
+  // bits until the next error follow a geometric distribution
+  double uniform = errors.random.uniform();
+  double gap = std::log(1.0 - uniform) / std::log(1.0 - m_bitErrorRate);
+  errors.bitsToError = gap < 1e18 ? (uint64_t) gap : (uint64_t) 1e18;
+}
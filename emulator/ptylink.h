@@ -0,0 +1,118 @@
+#ifndef PTYLINK_H
+#define PTYLINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// xorshift64: the same seed gives the same errors and drops on every run
+class LinkRandom
+{
+public:
+  explicit LinkRandom(uint64_t seed = 1);
+
+  void seed(uint64_t seed);
+
+  uint64_t next();
+
+  // uniform in [0, 1)
+  double uniform();
+
+private:
+  uint64_t m_state;
+};
+
+/*
+ * The device end of a pseudo-terminal, made to look like a serial line.
+ * The client opens slaveName() as a serial port.
+ * Bytes go through the line at baudRate / 10 bytes per second (start + 8 data
+ * + stop bits) in each direction, whatever the pty itself could do, and every
+ * bit is flipped with bitErrorRate probability on its way.
+ * Times are in nanoseconds of a monotonic clock (see monotonicNanos).
+*/
+class PtyLink
+{
+public:
+  PtyLink();
+  ~PtyLink();
+
+  // symlink may be NULL, otherwise it is made to point to the slave
+  bool open(const char* symlinkPath);
+
+  void close();
+
+  const char* slaveName() const;
+
+  int fd() const;
+
+  // baudRate 0: no pacing
+  void configure(int baudRate, double bitErrorRate, uint64_t seed);
+
+  // bytes that finished arriving by now, at most size
+  size_t receive(uint8_t* data, size_t size, int64_t now);
+
+  // queued to go out once now >= readyAt, after what was queued before
+  void send(const uint8_t* data, size_t length, int64_t readyAt);
+
+  // writes what the line let through by now
+  void flush(int64_t now);
+
+  // when something may happen without new input, -1 if nothing is waiting
+  int64_t nextEvent() const;
+
+  // the line has room for more from the pty: poll it for POLLIN
+  bool canReceive() const;
+
+  // the pty was full on the last flush: poll it for POLLOUT
+  bool isTxBlocked() const;
+
+  uint64_t bitErrors() const;
+
+  static int64_t monotonicNanos();
+
+private:
+  // what the pty buffer may hold ahead of the line: the rest waits in the client
+  static const size_t RX_LINE_BUFFER = 4096;
+
+  struct TxFrame
+  {
+    int64_t readyAt;
+    std::vector<uint8_t> data;
+    size_t written;
+    size_t corrupted;
+  };
+
+  int m_master;
+  int m_slave; // kept open so the master does not fail while no client is connected
+  char m_slaveName[64];
+  char m_symlink[256];
+
+  int64_t m_bytePeriod; // 0 for no pacing
+  double m_bitErrorRate;
+  uint64_t m_bitErrors;
+
+  // one per direction, so the errors in one do not depend on the timing of the other
+  struct BitErrors
+  {
+    LinkRandom random;
+    uint64_t bitsToError; // bits that go through fine before the next error
+  };
+  BitErrors m_rxErrors;
+  BitErrors m_txErrors;
+
+  std::deque<uint8_t> m_rxLine; // read from the pty, still on the line
+  int64_t m_rxLineAt;           // the line is busy until then
+  std::deque<TxFrame> m_txQueue;
+  int64_t m_txLineAt;
+  bool m_txBlocked;
+
+  void corrupt(BitErrors& errors, uint8_t* data, size_t length);
+
+  void nextBitError(BitErrors& errors);
+
+  // bytes the line can carry from lineAt to now, lineAt is moved past them
+  size_t lineBudget(int64_t& lineAt, int64_t now, size_t wanted) const;
+};
+
+#endif // PTYLINK_H
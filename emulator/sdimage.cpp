@@ -0,0 +1,153 @@
+#include "sdimage.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+SdImage::SdImage()
+{
+  m_fd = -1;
+  m_blocksCount = 0;
+  m_lastBlock = DIRECTORY_BLOCKS;
+  m_filesCount = 0;
+  memset(m_files, 0, sizeof(m_files));
+}
+
+SdImage::~SdImage()
+{
+  close();
+}
+
+bool SdImage::open(const char* path, uint32_t blocksCount, bool format)
+{
+  close();
+
+  if(blocksCount <= (uint32_t) DIRECTORY_BLOCKS)
+  {
+    fprintf(stderr, "SD image too small: %u blocks\n", blocksCount);
+    return false;
+  }
+
+  if(path != NULL)
+  {
+    m_fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  }
+  else
+  {
+    char name[] = "/tmp/sdimageXXXXXX";
+    m_fd = mkstemp(name);
+    if(m_fd >= 0)
+      unlink(name);
+  }
+
+  // a new image reads as zeros: an empty directory
+  if(m_fd < 0 || ftruncate(m_fd, (off_t) blocksCount * BLOCK_SIZE) != 0)
+  {
+    perror(path != NULL ? path : "SD image");
+    close();
+    return false;
+  }
+  m_blocksCount = blocksCount;
+
+  if(format && pwrite(m_fd, m_files, sizeof(m_files), 0) != (ssize_t) sizeof(m_files))
+  {
+    perror("SD image format");
+    close();
+    return false;
+  }
+
+  if(pread(m_fd, m_files, sizeof(m_files), 0) != (ssize_t) sizeof(m_files))
+  {
+    perror("SD image directory");
+    close();
+    return false;
+  }
+
+  while(m_filesCount < MAX_FILES && m_files[m_filesCount].length > 0)
+  {
+    const fileheader_data_t& file = m_files[m_filesCount];
+    uint32_t end = file.block_start + blocksFor(file.length);
+    if(file.block_start < (uint32_t) DIRECTORY_BLOCKS || end > m_blocksCount)
+      break; // not written by us, ignore the rest
+    if(end > m_lastBlock)
+      m_lastBlock = end;
+    m_filesCount++;
+  }
+
+  return true;
+}
+
+void SdImage::close()
+{
+  if(m_fd >= 0)
+    ::close(m_fd);
+
+  m_fd = -1;
+  m_blocksCount = 0;
+  m_lastBlock = DIRECTORY_BLOCKS;
+  m_filesCount = 0;
+  memset(m_files, 0, sizeof(m_files));
+}
+
+uint32_t SdImage::blocksCount() const
+{
+  return m_blocksCount;
+}
+
+uint32_t SdImage::lastBlock() const
+{
+  return m_lastBlock;
+}
+
+int SdImage::filesCount() const
+{
+  return m_filesCount;
+}
+
+const fileheader_data_t& SdImage::file(int index) const
+{
+  return m_files[index];
+}
+
+uint32_t SdImage::blocksFor(uint32_t length)
+{
+  return (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+uint32_t SdImage::allocate(uint32_t length) const
+{
+  if(m_filesCount >= MAX_FILES || length == 0)
+    return 0;
+
+  if(blocksFor(length) > m_blocksCount - m_lastBlock)
+    return 0;
+
+  return m_lastBlock;
+}
+
+bool SdImage::write(uint32_t block, uint32_t offset, const uint8_t* data, size_t length)
+{
+  uint64_t position = (uint64_t) block * BLOCK_SIZE + offset;
+
+  if(m_fd < 0 || block < (uint32_t) DIRECTORY_BLOCKS
+     || position + length > (uint64_t) m_blocksCount * BLOCK_SIZE)
+    return false;
+
+  return pwrite(m_fd, data, length, position) == (ssize_t) length;
+}
+
+bool SdImage::addFile(const fileheader_data_t& header)
+{
+  if(m_fd < 0 || m_filesCount >= MAX_FILES)
+    return false;
+
+  off_t position = m_filesCount * sizeof(fileheader_data_t);
+  if(pwrite(m_fd, &header, sizeof(header), position) != (ssize_t) sizeof(header))
+    return false;
+
+  m_files[m_filesCount++] = header;
+  if(header.block_start + blocksFor(header.length) > m_lastBlock)
+    m_lastBlock = header.block_start + blocksFor(header.length);
+
+  return true;
+}
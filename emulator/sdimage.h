@@ -0,0 +1,58 @@
+#ifndef SDIMAGE_H
+#define SDIMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include "protocol.h"
+
+/*
+ * The SD card of the emulated device, kept in a file of BLOCK_SIZE blocks.
+ * The first DIRECTORY_BLOCKS blocks hold a fileheader_data_t per stored file
+ * (a zero length ends the list), and the audio of each file goes in consecutive
+ * blocks from its block_start on. Files are only appended, like on the device.
+*/
+class SdImage
+{
+public:
+  static const int BLOCK_SIZE = 512;
+  static const int MAX_FILES = 32; // what a status response can list
+  static const int DIRECTORY_BLOCKS = MAX_FILES * sizeof(fileheader_data_t) / BLOCK_SIZE;
+
+  SdImage();
+  ~SdImage();
+
+  // path NULL: an unnamed temporary file. an existing image keeps its files
+  // unless format is set, its size is blocksCount blocks either way
+  bool open(const char* path, uint32_t blocksCount, bool format);
+
+  void close();
+
+  uint32_t blocksCount() const;
+
+  // first block after the last file
+  uint32_t lastBlock() const;
+
+  int filesCount() const;
+
+  const fileheader_data_t& file(int index) const;
+
+  // blocks needed for length bytes
+  static uint32_t blocksFor(uint32_t length);
+
+  // where a file of length bytes would start, or 0 if it does not fit
+  uint32_t allocate(uint32_t length) const;
+
+  bool write(uint32_t block, uint32_t offset, const uint8_t* data, size_t length);
+
+  // adds the file to the directory, its audio must be written already
+  bool addFile(const fileheader_data_t& header);
+
+private:
+  int m_fd;
+  uint32_t m_blocksCount;
+  uint32_t m_lastBlock;
+  int m_filesCount;
+  fileheader_data_t m_files[MAX_FILES];
+};
+
+#endif // SDIMAGE_H
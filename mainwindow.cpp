@@ -52,29 +52,52 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->groupBox_DeviceControl->setEnabled(false);
     ui->groupBox_AudioProgress->setEnabled(false);
 
-    m_client = new Client(this);
-    m_ffmpegProcess = new QProcess(this);
+    // serial I/O, parsing and timers run on their own thread, so a busy GUI
+    // can not delay keep-alives or let the rx buffer overrun
+    m_ioThread = new QThread(this);
+    m_client = new Client();
+    m_client->moveToThread(m_ioThread);
+    connect(m_ioThread, SIGNAL(finished()), m_client, SLOT(deleteLater()));
+    m_ioThread->start();
+    // decoding and resampling would stall the GUI, and the client thread too
+    m_convertThread = new QThread(this);
+    m_converter = new AudioConverter();
+    m_converter->moveToThread(m_convertThread);
+    connect(m_convertThread, SIGNAL(finished()), m_converter, SLOT(deleteLater()));
+    m_convertThread->start();
+    m_converting = false;
+    m_stream = NULL;
+    m_filesUploaded = false;
 
     m_settings = new QSettings("Grupo 4", "TPO Info 2");
 
-    connect(m_client->getSerialPort(), SIGNAL(error(QSerialPort::SerialPortError)), this, SLOT(handleSerialError(QSerialPort::SerialPortError)));
+    // converted audio is kept, so sending the same files again starts at once
+    m_uploadQueue = new UploadQueue(m_client,
+                                    QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/pcm",
+                                    m_settings->value("cache-size-mb", DEFAULT_CACHE_SIZE_MB).toLongLong() * 1024 * 1024,
+                                    this);
+
+    connect(m_client, SIGNAL(serialError(QString)), this, SLOT(handleSerialError(QString)));
 
 
     connect(m_client, SIGNAL(deviceStatusChanged(bool)), this, SLOT(handleDeviceStatusChanged(bool)));
-    connect(m_client, SIGNAL(infoStatusResponse(bool, status_hdr_t*,QList<QString>*)),SLOT(handleInfoStatusResponse(bool , status_hdr_t*,QList<QString>*)));
+    connect(m_client, SIGNAL(infoStatusResponse(bool, status_hdr_t, QStringList)),SLOT(handleInfoStatusResponse(bool, status_hdr_t, QStringList)));
     connect(m_client, SIGNAL(sendFileHeaderResponse(bool)), this, SLOT(handleSendFileHeaderResponse(bool)));
     connect(m_client, SIGNAL(sendFileChunkResponse(bool,uint32_t, uint32_t)), this, SLOT(handleSendFileChunkResponse(bool,uint32_t, uint32_t)));
+    connect(m_client, SIGNAL(sendFileProgress(uint32_t, uint32_t)), this, SLOT(handleSendFileProgress(uint32_t, uint32_t)));
+    connect(m_client, SIGNAL(sendFileFinished(bool)), this, SLOT(handleSendFileFinished(bool)));
     connect(m_client, SIGNAL(sendCommandResponse(bool)), this, SLOT(handleSendCommandResponse(bool)));
+    connect(m_client, SIGNAL(commandLatency(qint64)), this, SLOT(handleCommandLatency(qint64)));
     connect(m_client, SIGNAL(log(QString)),SLOT(handleClientLog(QString)));
 
 
 
-    connect(m_ffmpegProcess, SIGNAL(started()),SLOT(handleFfmpegProcessStarted()));
-    connect(m_ffmpegProcess, SIGNAL(error(QProcess::ProcessError )),SLOT(handleFfmpegProcessError(QProcess::ProcessError )));
-    connect(m_ffmpegProcess, SIGNAL(finished(int , QProcess::ExitStatus )),SLOT(handleFfmpegProcessFinished(int , QProcess::ExitStatus )));
-    connect(m_ffmpegProcess, SIGNAL(readyRead()),SLOT(handleFfmpegProcessReadyRead()));
-    connect(m_ffmpegProcess, SIGNAL(readyReadStandardError()),SLOT(handleFfmpegProcessReadyRead()));
-    connect(m_ffmpegProcess, SIGNAL(readyReadStandardOutput()),SLOT(handleFfmpegProcessReadyRead()));
+    connect(m_converter, SIGNAL(finished(bool)), SLOT(handleConversionFinished(bool)));
+    connect(m_converter, SIGNAL(log(QString)), SLOT(handleConverterLog(QString)));
+    connect(&m_streamUpload, SIGNAL(finished()), SLOT(handleStreamUploadFinished()));
+    connect(m_uploadQueue, SIGNAL(fileFinished(int, int, QString, bool)), SLOT(handleQueuedFileFinished(int, int, QString, bool)));
+    connect(m_uploadQueue, SIGNAL(finished(int, int)), SLOT(handleUploadQueueFinished(int, int)));
+    connect(m_uploadQueue, SIGNAL(log(QString)), SLOT(handleConverterLog(QString)));
 
 
 
@@ -88,17 +111,19 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
+  // m_client and m_converter are deleted on their own threads when they finish
+  m_converter->cancel();
+  m_convertThread->quit();
+  m_convertThread->wait();
+  m_ioThread->quit();
+  m_ioThread->wait();
   delete ui;
-  delete m_client;
 }
 
 
-void MainWindow::handleSerialError(QSerialPort::SerialPortError error)
+void MainWindow::handleSerialError(QString errorString)
 {
-  if(error ==QSerialPort::NoError)
-    return;
-
-  log(QString("Error Critico en puerto serie: %1").arg(m_client->getSerialPort()->errorString()));
+  log(QString("Error Critico en puerto serie: %1").arg(errorString));
   closeSerialPort();
 }
 
@@ -137,43 +162,38 @@ void MainWindow::on_toolButton_Next_clicked()
 void MainWindow::on_toolButton_Upload_clicked()
 {
 
-  QString program = "ffmpeg";
-  QStringList arguments;
-  QString filename;
+  QStringList filenames;
+  int sampleRate;
 
-  filename = QFileDialog::getOpenFileName( this,"Seleccionar Archivo de Audio", "", "Archivo de Audio (*.wav *.mp3)");
-  QFileInfo fileInfo(filename);
-  m_shortFilename = fileInfo.fileName().toUpper();
-  m_tmpFile = new QTemporaryFile(this);
+  filenames = QFileDialog::getOpenFileNames( this,"Seleccionar Archivos de Audio", "", "Archivo de Audio (*.wav *.mp3)");
+  sampleRate = ui->comboBox_SampleRate->currentData().toInt();
 
-  if (filename != "")
+  if (!filenames.isEmpty())
   {
+    m_settings->setValue("sample-rate", sampleRate);
 
-    if (m_tmpFile->open()) {
-      // this is only to get a valid tmp filename
-
-      m_settings->setValue("sample-rate",ui->comboBox_SampleRate->currentData().toInt() );
-
-      // contruye el comando: ffmpeg -i source -ac 1 -sample_fmt u8 -acodec pcm_u8 -f u8 -y -ar 8000 /tmp.file
-
-      arguments << "-i" << filename;
-      arguments << "-ac" << "1"; // audo channels: mono
-      arguments << "-sample_fmt" << "u8"; //8 bit sample depth
-      arguments << "-acodec" << "pcm_u8"; // audio codec: pcm 8 bit
-      arguments << "-f" << "u8"; // format is PCM... headless WAV
-      arguments << "-y"; //overwrite if file exists... it will exists
-      arguments << "-ar" <<  ui->comboBox_SampleRate->currentData().toString(); // audio sample rate
-      arguments << m_tmpFile->fileName();
-
-      log(QString("Ejecutando: %1 %2").arg(program).arg(arguments.join(" ")));
-      m_ffmpegProcess->setProcessChannelMode(QProcess::MergedChannels);
-      m_ffmpegProcess->start(program, arguments);
-
-      ui->groupBox_DeviceControl->setEnabled(false);
-      ui->groupBox_AudioProgress->setEnabled(true);
-
+    // mono, 8 bit unsigned PCM, headless: what the device plays
+    if(filenames.size() == 1 && m_client->isStreamingSupported() && !isUploading())
+    {
+      // the device takes the audio while it is converted, no temporary file needed
+      QString shortFilename = QFileInfo(filenames.first()).fileName().toUpper();
+      log(QString("Convirtiendo y enviando audio..."));
+      m_stream = new StreamChunkSource(STREAM_BUFFER_SIZE, this);
+      m_streamUpload.setFuture(m_client->sendStreamAsync(m_stream, sampleRate, shortFilename));
+      m_converting = true;
+      m_converter->convertToStream(filenames.first(), sampleRate, m_stream);
+    }
+    else
+    {
+      // uploads already running keep going, these are sent after them
+      log(QString("Convirtiendo %1 archivo(s)...").arg(filenames.size()));
+      m_uploadQueue->add(filenames, sampleRate);
+      ui->progressBar->setFormat(QString("%p% (%1/%2)").arg(m_uploadQueue->done() + 1).arg(m_uploadQueue->count()));
     }
 
+    ui->groupBox_DeviceControl->setEnabled(false);
+    ui->groupBox_AudioProgress->setEnabled(true);
+
   }
 }
 
@@ -185,7 +205,7 @@ void MainWindow::on_pushButton_RefreshPortList_clicked()
 
 void MainWindow::on_pushButton_Connect_clicked()
 {
-  if (m_client->getSerialPort()->isOpen())
+  if (m_client->isSerialPortOpen())
     closeSerialPort();
   else
     openSerialPort();
@@ -236,7 +256,7 @@ void MainWindow::loadSampleRateList()
 
 void MainWindow::updateConnectButtonLabel()
 {
-  if(m_client->getSerialPort()->isOpen())
+  if(m_client->isSerialPortOpen())
   {
     ui->comboBox_PortList->setEnabled(false);
     ui->comboBox_BaudRate->setEnabled(false);
@@ -256,7 +276,7 @@ void MainWindow::updateConnectButtonLabel()
 void MainWindow::openSerialPort()
 {
   QString port = ui->comboBox_PortList->currentData().toString();
-  uint16_t baudRate = ui->comboBox_BaudRate->currentData().toInt();
+  qint32 baudRate = ui->comboBox_BaudRate->currentData().toInt();
   //save settings for next time
   m_settings->setValue("baud-rate",baudRate );
 
@@ -326,7 +346,7 @@ void MainWindow::handleDeviceStatusChanged(bool connected)
 
 }
 
-void MainWindow::handleInfoStatusResponse(bool success, status_hdr_t* status, QList<QString> *fileList)
+void MainWindow::handleInfoStatusResponse(bool success, status_hdr_t status, QStringList fileList)
 {
   ui->listWidget_DeviceAudios->clear();
   ui->groupBox_DeviceControl->setEnabled(success);
@@ -335,11 +355,11 @@ void MainWindow::handleInfoStatusResponse(bool success, status_hdr_t* status, QL
   if(success)
   {
     log(QString("Estado del dispositivo recibida."));
-    log(QString(" --> Bloques:       %1.").arg(status->blocks_count));
-    log(QString(" --> Ultimo Bloque: %1.").arg(status->last_block));
-    log(QString(" --> Audios:        %1.").arg(status->files_count));
+    log(QString(" --> Bloques:       %1.").arg(status.blocks_count));
+    log(QString(" --> Ultimo Bloque: %1.").arg(status.last_block));
+    log(QString(" --> Audios:        %1.").arg(status.files_count));
 
-    foreach (const QString &filename, *fileList) {
+    foreach (const QString &filename, fileList) {
       ui->listWidget_DeviceAudios->addItem(filename);
     }
 
@@ -364,6 +384,11 @@ void MainWindow::handleSendCommandResponse(bool success)
 
 }
 
+void MainWindow::handleCommandLatency(qint64 milliseconds)
+{
+  log(QString("Comando respondido en %1 ms.").arg(milliseconds));
+}
+
 void MainWindow::handleSendFileHeaderResponse(bool success)
 {
   if(success)
@@ -373,9 +398,6 @@ void MainWindow::handleSendFileHeaderResponse(bool success)
   else
   {
     log(QString("Envio de Audio Rechazado."));
-    ui->groupBox_DeviceControl->setEnabled(true);
-    ui->groupBox_AudioProgress->setEnabled(false);
-
   }
 }
 
@@ -384,31 +406,29 @@ void MainWindow::handleSendFileChunkResponse(bool success, uint32_t chunk_id, ui
   if(success)
   {
     //log(QString("Chunk %1 / %2 recibido con éxito.").arg(chunk_id).arg(chunksCount));
-
-    //fixme: not accurate at all!
-
-    float progress = float(chunk_id) / float(chunksCount-1);
-    ui->progressBar->setValue((int) qRound(progress*100.0f));
-
-    if(chunk_id==chunksCount-1)
-    {
-      //todo: send a confirmation request...
-      log(QString("Ultimo chunk de archivo recibido."));
-      QTimer::singleShot(3000,this, SLOT(fileTransferCompleted));
-      ui->groupBox_DeviceControl->setEnabled(true);
-      ui->groupBox_AudioProgress->setEnabled(false);
-    }
-
   }
   else
   {
-    log(QString("Fallo la recepción de chunk %1 .").arg(chunk_id));
-    ui->groupBox_DeviceControl->setEnabled(true);
-    ui->groupBox_AudioProgress->setEnabled(false);
-
+    log(QString("Fallo la recepción de chunk %1 / %2 .").arg(chunk_id).arg(chunksCount));
   }
 }
 
+void MainWindow::handleSendFileProgress(uint32_t chunksAcked, uint32_t chunksCount)
+{
+  // chunks are acknowledged out of order, so count them instead of using chunk_id
+  float progress = float(chunksAcked) / float(chunksCount);
+  ui->progressBar->setValue((int) qRound(progress*100.0f));
+}
+
+void MainWindow::handleSendFileFinished(bool success)
+{
+  // the controls come back in uploadsFinished(), after the last file
+  if(success)
+    log(QString("Ultimo chunk de archivo recibido."));
+  else
+    log(QString("Envio de Audio cancelado."));
+}
+
 void MainWindow::fileTransferCompleted()
 {
   m_client->getDeviceStatus();
@@ -418,38 +438,101 @@ void MainWindow::fileTransferCompleted()
 
 
 
-void MainWindow::handleFfmpegProcessStarted()
+/*
+ * the converter only works for streaming uploads, the stream is already
+ * finished or aborted
+*/
+void MainWindow::handleConversionFinished(bool success)
+{
+  m_converting = false;
+
+  if(!success)
+    log(QString("Conversion finalizada con errores."));
+  releaseStream();
+  uploadsFinished();
+}
+
+void MainWindow::handleConverterLog(QString message)
+{
+  log(message);
+}
+
+/*
+ * the client is done with the stream, whatever the result
+*/
+void MainWindow::handleStreamUploadFinished()
 {
-  log(QString("ffmpeg process started."));
+  if(m_stream == NULL)
+    return;
+
+  if(m_converting)
+    m_converter->cancel(); // the upload failed, the rest is not needed
+
+  if(m_streamUpload.result().error == REQUEST_OK)
+    m_filesUploaded = true;
 
+  releaseStream();
+  uploadsFinished();
 }
 
-void MainWindow::handleFfmpegProcessError(QProcess::ProcessError error)
+/*
+ * deleted once both the converter and the client are done with it
+*/
+void MainWindow::releaseStream()
 {
-  log(QString("ffmpeg Process Error: %1").arg(error));
+  if(m_converting || !m_streamUpload.isFinished())
+    return;
 
+  m_stream->deleteLater();
+  m_stream = NULL;
 }
 
-void MainWindow::handleFfmpegProcessFinished(int exitCode, QProcess::ExitStatus exitStatus)
+void MainWindow::handleQueuedFileFinished(int index, int count, QString name, bool success)
 {
-  log(QString("ffmpeg Process Finished. Exit code: %1 . Exit status: %2").arg(exitCode).arg(exitStatus));
-  if(exitCode==0 && exitStatus==0)
+  if(success)
   {
-    log(QString("Conversion finalizada correctamente. Enviando audio..."));
-    m_client->sendFile(m_tmpFile, ui->comboBox_SampleRate->currentData().toInt(), m_shortFilename);
+    log(QString("[%1/%2] %3 enviado.").arg(index + 1).arg(count).arg(name));
+    m_filesUploaded = true;
   }
   else
   {
-    log(QString("Conversion finalizada con errores."));
+    log(QString("[%1/%2] %3 no se pudo enviar, se continua con el resto.").arg(index + 1).arg(count).arg(name));
   }
 
+  // the bar follows the file being sent
+  ui->progressBar->setValue(0);
+  ui->progressBar->setFormat(QString("%p% (%1/%2)").arg(qMin(m_uploadQueue->done() + 1, count)).arg(count));
 }
 
+void MainWindow::handleUploadQueueFinished(int uploaded, int failed)
+{
+  log(QString("Envio finalizado: %1 archivo(s) enviados, %2 con errores.").arg(uploaded).arg(failed));
+  ui->progressBar->setFormat(QString("%p%"));
+  uploadsFinished();
+}
 
+/*
+ * the controls come back once nothing is left to convert or send
+*/
+void MainWindow::uploadsFinished()
+{
+  if(isUploading())
+    return;
+
+  //todo: send a confirmation request...
+  if(m_filesUploaded)
+    QTimer::singleShot(3000,this, SLOT(fileTransferCompleted()));
+  m_filesUploaded = false;
+  ui->groupBox_DeviceControl->setEnabled(true);
+  ui->groupBox_AudioProgress->setEnabled(false);
+}
 
-void MainWindow::handleFfmpegProcessReadyRead()
+/*
+ * a streaming upload, or files of the queue, not finished yet
+*/
+bool MainWindow::isUploading() const
 {
-  log(m_ffmpegProcess->readAll(), false);
+  return m_converting || m_stream != NULL || m_uploadQueue->isBusy();
 }
 
 void MainWindow::handleClientLog(QString message)
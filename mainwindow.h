@@ -52,10 +52,14 @@
 #include <QFileDialog>
 
 #include <QTemporaryFile>
-#include <QProcess>
+#include <QThread>
+#include <QFutureWatcher>
+#include <QStandardPaths>
 
 #include "ui_mainwindow.h"
 #include "client.h"
+#include "audioconverter.h"
+#include "uploadqueue.h"
 
 
 QT_BEGIN_NAMESPACE
@@ -96,34 +100,54 @@ private slots:
 
   void handleDeviceStatusChanged(bool connected);
 
-  void handleInfoStatusResponse(bool success, status_hdr_t* status, QList<QString>*fileList);
+  void handleInfoStatusResponse(bool success, status_hdr_t status, QStringList fileList);
 
   void handleSendCommandResponse(bool success);
 
+  void handleCommandLatency(qint64 milliseconds);
+
   void handleSendFileHeaderResponse(bool success);
 
   void handleSendFileChunkResponse(bool success, uint32_t chunk_id, uint32_t chunksCount);
 
+  void handleSendFileProgress(uint32_t chunksAcked, uint32_t chunksCount);
+
+  void handleSendFileFinished(bool success);
+
   void fileTransferCompleted();
 
-  void 	handleFfmpegProcessStarted();
+  void handleConversionFinished(bool success);
+
+  void handleConverterLog(QString message);
 
-  void 	handleFfmpegProcessError(QProcess::ProcessError error);
+  void handleStreamUploadFinished();
 
-  void 	handleFfmpegProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
+  void handleQueuedFileFinished(int index, int count, QString name, bool success);
 
-  void 	handleFfmpegProcessReadyRead();
+  void handleUploadQueueFinished(int uploaded, int failed);
 
   void 	handleClientLog(QString message);
 
-  void handleSerialError(QSerialPort::SerialPortError bufferError);
+  void handleSerialError(QString errorString);
 
 private:
+  // the converted audio waiting to be sent: enough for a whole upload window
+  const int STREAM_BUFFER_SIZE = (MAX_MSG_WINDOW + 1) * FILECHUNK_SIZE;
+  // converted audio kept on disk, unless the "cache-size-mb" setting says otherwise
+  const int DEFAULT_CACHE_SIZE_MB = 512;
+
   Ui::MainWindow *ui;
   Client *m_client;
-  QTemporaryFile *m_tmpFile;
-  QProcess *m_ffmpegProcess;
-  QString m_shortFilename;
+  QThread *m_ioThread;
+  QThread *m_convertThread;
+  AudioConverter *m_converter;
+  bool m_converting;
+  // streaming: the upload starts with the conversion, no temporary file
+  StreamChunkSource *m_stream;
+  QFutureWatcher<RequestReply> m_streamUpload;
+  // several files, or no streaming: converted in parallel, uploaded in turn
+  UploadQueue *m_uploadQueue;
+  bool m_filesUploaded; // since the controls were disabled
   QSettings* m_settings;
 
   void openSerialPort();
@@ -140,6 +164,12 @@ private:
 
   void log(QString msg, bool newLine=true);
 
+  void releaseStream();
+
+  bool isUploading() const;
+
+  void uploadsFinished();
+
 };
 
 #endif // MAINWINDOW_H
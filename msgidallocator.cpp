@@ -0,0 +1,114 @@
+#include "msgidallocator.h"
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline int countTrailingZeros(quint64 value)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, value);
+  return (int) index;
+#else
+  return __builtin_ctzll(value);
+#endif
+}
+
+MsgIdAllocator::MsgIdAllocator()
+{
+  memset(m_used, 0, sizeof(m_used));
+  m_inUse = 0;
+  m_next = 0;
+  configure(LEGACY_MSG_WINDOW, LEGACY_MSG_WINDOW);
+}
+
+void MsgIdAllocator::configure(int idSpace, int window)
+{
+  m_idSpace = qBound(1, idSpace, MAX_IDS);
+  m_window = qBound(1, window, m_idSpace);
+  if(m_next >= m_idSpace)
+    m_next = 0;
+}
+
+int MsgIdAllocator::allocate()
+{
+  if(isFull())
+    return -1;
+
+  // from m_next to the end, then wrap around
+  int id = findFree(m_next, m_idSpace);
+  if(id < 0)
+    id = findFree(0, m_next);
+  if(id < 0)
+    return -1; // ids beyond a smaller space may still be in use
+
+  m_used[id / 64] |= (quint64) 1 << (id % 64);
+  m_inUse++;
+  m_next = (id + 1) % m_idSpace;
+  return id;
+}
+
+/*
+ * first free id in [from, to), or -1
+*/
+int MsgIdAllocator::findFree(int from, int to) const
+{
+  for(int word = from / 64; word * 64 < to; word++)
+  {
+    quint64 free = ~m_used[word];
+
+    if(word == from / 64)
+      free &= ~(quint64) 0 << (from % 64);
+
+    if(free == 0)
+      continue;
+
+    int id = word * 64 + countTrailingZeros(free);
+    return id < to ? id : -1;
+  }
+  return -1;
+}
+
+void MsgIdAllocator::release(int id)
+{
+  if(!isUsed(id))
+    return;
+
+  m_used[id / 64] &= ~((quint64) 1 << (id % 64));
+  m_inUse--;
+}
+
+void MsgIdAllocator::releaseAll()
+{
+  memset(m_used, 0, sizeof(m_used));
+  m_inUse = 0;
+}
+
+bool MsgIdAllocator::isUsed(int id) const
+{
+  if(id < 0 || id >= MAX_IDS)
+    return false;
+  return (m_used[id / 64] >> (id % 64)) & 1;
+}
+
+bool MsgIdAllocator::isFull() const
+{
+  return m_inUse >= m_window;
+}
+
+int MsgIdAllocator::inUse() const
+{
+  return m_inUse;
+}
+
+int MsgIdAllocator::window() const
+{
+  return m_window;
+}
+
+int MsgIdAllocator::idSpace() const
+{
+  return m_idSpace;
+}
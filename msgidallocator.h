@@ -0,0 +1,56 @@
+#ifndef MSGIDALLOCATOR_H
+#define MSGIDALLOCATOR_H
+
+#include <QtGlobal>
+#include "protocol.h"
+
+/*
+ * Hands out msg ids for requests.
+ * Ids in use are kept in a 256 bit bitmap, a free one is found with count
+ * trailing zeros on at most five words, so allocating does not depend on
+ * the window size.
+ * Ids go round-robin over the id space: a released id is only used again
+ * after all the others, which keeps late responses from matching new requests.
+*/
+class MsgIdAllocator
+{
+public:
+  static const int MAX_IDS = 256;
+
+  MsgIdAllocator();
+
+  // ids go from 0 to idSpace - 1, at most window of them in use.
+  // ids already in use stay in use
+  void configure(int idSpace, int window);
+
+  // returns the id, or -1 if the window is full
+  int allocate();
+
+  void release(int id);
+
+  void releaseAll();
+
+  bool isUsed(int id) const;
+
+  bool isFull() const;
+
+  int inUse() const;
+
+  int window() const;
+
+  int idSpace() const;
+
+private:
+  static const int WORDS = MAX_IDS / 64;
+
+  quint64 m_used[WORDS];
+  int m_inUse;
+  int m_window;
+  int m_idSpace;
+  int m_next; // where the search for a free id starts
+
+  int findFree(int from, int to) const;
+
+};
+
+#endif // MSGIDALLOCATOR_H
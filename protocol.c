@@ -16,22 +16,29 @@ End of Multi Language Header
 
 /*START OF C/C++ COMMON CODE - (do not code above this line)*/
 #include "protocol.h"
+#include <string.h>
+#include "crctables.h"
 
 
-static uint8_t raw_rx_buffer[RAW_RX_BUFFER_SIZE];
-static int raw_rx_buffer_in_index = 0;
-static int raw_rx_buffer_out_index = 0;
-static int unframed_data_count = 0;
-static buffer_status_t buffer_status = BUFFER_NOT_SOF; //initial buffer state
+// context used by the functions that do not take one
+// zero initialized, which is the initial buffer state
+static protocol_ctx_t default_ctx;
 
 //static functions prototypes
-static uint8_t validate_buffer_checksum();
-static int validate_end_of_frame();
-static uint16_t buffered_message_data_length();
-static int buffered_message_length();
-static uint8_t raw_rx_buffer_at(int i);
-static int raw_rx_buffer_pos(int i);
-static int raw_rx_buffer_count();
+static uint8_t validate_buffer_checksum(protocol_ctx_t* ctx);
+static int validate_end_of_frame(protocol_ctx_t* ctx);
+static uint16_t buffered_message_data_length(protocol_ctx_t* ctx);
+static int buffered_message_length(protocol_ctx_t* ctx);
+static uint8_t raw_rx_buffer_at(protocol_ctx_t* ctx, int i);
+static int raw_rx_buffer_pos(protocol_ctx_t* ctx, int i);
+static int raw_rx_buffer_count(protocol_ctx_t* ctx);
+static void skip_to_start_of_frame(protocol_ctx_t* ctx);
+static void update_buffer_checksum(protocol_ctx_t* ctx);
+static void reset_cobs_frame(protocol_ctx_t* ctx);
+static buffer_status_t process_cobs_frame(protocol_ctx_t* ctx);
+static uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t length);
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t length);
+
 
 
 uint8_t messageGetChecksum(message_hdr_t* message, uint8_t* data)
@@ -48,14 +55,225 @@ uint8_t messageGetChecksum(message_hdr_t* message, uint8_t* data)
   return result;
 }
 
+/*
+ * integrity check of a message with the given mode
+ * only the lowest protocolChecksumSize(mode) bytes are sent
+*/
+uint32_t messageGetIntegrity(integrity_mode_t mode, message_hdr_t* message, uint8_t* data)
+{
+  uint32_t state = protocolChecksumInit(mode);
+  state = protocolChecksumUpdate(mode, state, (uint8_t*) message, sizeof(message_hdr_t));
+  state = protocolChecksumUpdate(mode, state, data, message->data_length);
+  return protocolChecksumFinal(mode, state);
+}
+
+uint8_t protocolChecksumSize(integrity_mode_t mode)
+{
+  switch(mode){
+    case INTEGRITY_CRC16:
+      return 2;
+    case INTEGRITY_CRC32:
+      return 4;
+    default:
+      return 1;
+  }
+}
 
+/*
+ * streaming checksum: init, then update with every piece of data, then final.
+ * the state can be kept between pieces, so no second pass is needed
+*/
+uint32_t protocolChecksumInit(integrity_mode_t mode)
+{
+  switch(mode){
+    case INTEGRITY_CRC16:
+      return 0xFFFF;
+    case INTEGRITY_CRC32:
+      return 0xFFFFFFFF;
+    default:
+      return 0;
+  }
+}
+
+uint32_t protocolChecksumUpdate(integrity_mode_t mode, uint32_t state, const uint8_t* data, size_t length)
+{
+  const uint8_t* end = data + length;
+
+  switch(mode){
+    case INTEGRITY_CRC16:
+      return crc16_update((uint16_t) state, data, length);
+    case INTEGRITY_CRC32:
+      return crc32_update(state, data, length);
+    default:
+      for(; data < end; data++)
+        state ^= *data;
+      return state;
+  }
+}
+
+uint32_t protocolChecksumFinal(integrity_mode_t mode, uint32_t state)
+{
+  switch(mode){
+    case INTEGRITY_CRC16:
+      return state & 0xFFFF;
+    case INTEGRITY_CRC32:
+      return ~state;
+    default:
+      return state & 0xFF;
+  }
+}
+
+/*
+ * FNV-1a 64: start from CONTENT_HASH_INIT, feed the data in any pieces
+*/
+uint64_t contentHashUpdate(uint64_t hash, const uint8_t* data, size_t length)
+{
+  const uint8_t* end = data + length;
+
+  for(; data < end; data++)
+  {
+    hash ^= *data;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+uint64_t fileheaderContentHash(const fileheader_data_t* header)
+{
+  return ((uint64_t) header->content_hash[1] << 32) | header->content_hash[0];
+}
+
+void fileheaderSetContentHash(fileheader_data_t* header, uint64_t hash)
+{
+  header->content_hash[0] = (uint32_t) hash;
+  header->content_hash[1] = (uint32_t) (hash >> 32);
+}
+
+static uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t length)
+{
+  // eight bytes per step
+  for(; length >= 8; length -= 8, data += 8)
+  {
+    crc ^= (uint16_t) ((data[0] << 8) | data[1]);
+    crc = crc16_table[7][crc >> 8] ^ crc16_table[6][crc & 0xFF]
+        ^ crc16_table[5][data[2]] ^ crc16_table[4][data[3]]
+        ^ crc16_table[3][data[4]] ^ crc16_table[2][data[5]]
+        ^ crc16_table[1][data[6]] ^ crc16_table[0][data[7]];
+  }
+
+  for(; length > 0; length--, data++)
+    crc = (uint16_t) ((crc << 8) ^ crc16_table[0][(crc >> 8) ^ *data]);
+
+  return crc;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t length)
+{
+  // eight bytes per step
+  for(; length >= 8; length -= 8, data += 8)
+  {
+    uint32_t one = crc ^ ( data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24) );
+    crc = crc32_table[7][one & 0xFF] ^ crc32_table[6][(one >> 8) & 0xFF]
+        ^ crc32_table[5][(one >> 16) & 0xFF] ^ crc32_table[4][one >> 24]
+        ^ crc32_table[3][data[4]] ^ crc32_table[2][data[5]]
+        ^ crc32_table[1][data[6]] ^ crc32_table[0][data[7]];
+  }
+
+  for(; length > 0; length--, data++)
+    crc = (crc >> 8) ^ crc32_table[0][(crc ^ *data) & 0xFF];
+
+  return crc;
+}
+
+
+
+void protocolCtxInit(protocol_ctx_t* ctx)
+{
+  ctx->raw_rx_buffer_in_index = 0;
+  ctx->raw_rx_buffer_out_index = 0;
+  ctx->unframed_data_count = 0;
+  ctx->buffer_status = BUFFER_NOT_SOF;
+  ctx->resync_mode = RESYNC_CLEAR;
+  ctx->resync_count = 0;
+  ctx->integrity_mode = INTEGRITY_XOR;
+  ctx->framing_mode = FRAMING_SOF_EOF;
+  ctx->message_data_length = 0;
+  ctx->checked_count = 0;
+  ctx->running_checksum = 0;
+  reset_cobs_frame(ctx);
+}
+
+/*
+ * changes integrity and framing modes, eg. after a handshake
+ * should be called between messages: a message being received is restarted.
+ * a message ready to pop is released first, as its length depends on the old
+ * modes (a peeked one can still be read until more data is pushed)
+*/
+void protocolCtxSetModes(protocol_ctx_t* ctx, integrity_mode_t integrity, framing_mode_t framing)
+{
+  messagesBufferReleaseCtx(ctx);
+  ctx->integrity_mode = integrity;
+  ctx->framing_mode = framing;
+  reset_cobs_frame(ctx);
+}
 
-//todo: check if buffer is not full
 void messagesBufferPush ( uint8_t data )
 {
-  raw_rx_buffer[raw_rx_buffer_in_index] = data;
-  raw_rx_buffer_in_index++;
-  raw_rx_buffer_in_index %= RAW_RX_BUFFER_SIZE;
+  messagesBufferPushCtx(&default_ctx, data);
+}
+
+size_t messagesBufferPushBlock ( const uint8_t* data, size_t length )
+{
+  return messagesBufferPushBlockCtx(&default_ctx, data, length);
+}
+
+uint8_t* messagesBufferPop ( void)
+{
+  return messagesBufferPopCtx(&default_ctx);
+}
+
+buffer_status_t messagesBufferProcess ( void)
+{
+  return messagesBufferProcessCtx(&default_ctx);
+}
+
+void messagesBufferClear ()
+{
+  messagesBufferClearCtx(&default_ctx);
+}
+
+
+//todo: check if buffer is not full
+void messagesBufferPushCtx ( protocol_ctx_t* ctx, uint8_t data )
+{
+  ctx->raw_rx_buffer[ctx->raw_rx_buffer_in_index] = data;
+  ctx->raw_rx_buffer_in_index++;
+  ctx->raw_rx_buffer_in_index %= RAW_RX_BUFFER_SIZE;
+}
+
+/*
+ * pushes a block of received data at once
+ * returns how many bytes were pushed, which is less than length
+ * if the buffer got full: process and pop messages, then push the rest.
+*/
+size_t messagesBufferPushBlockCtx ( protocol_ctx_t* ctx, const uint8_t* data, size_t length )
+{
+  // one byte is left unused, so a full buffer does not look empty
+  size_t available = RAW_RX_BUFFER_SIZE - 1 - raw_rx_buffer_count(ctx);
+  size_t first;
+
+  if (length > available)
+    length = available;
+
+  // at most two copies: up to the end of the ring, then from its start
+  first = RAW_RX_BUFFER_SIZE - ctx->raw_rx_buffer_in_index;
+  if (first > length)
+    first = length;
+  memcpy(ctx->raw_rx_buffer + ctx->raw_rx_buffer_in_index, data, first);
+  memcpy(ctx->raw_rx_buffer, data + first, length - first);
+
+  ctx->raw_rx_buffer_in_index = ( ctx->raw_rx_buffer_in_index + length ) % RAW_RX_BUFFER_SIZE;
+  return length;
 }
 
 
@@ -71,62 +289,167 @@ void messagesBufferPush ( uint8_t data )
  * NOTE: be aware that this function allocates memory
  * and you are responsible for freeing it
 */
-uint8_t* messagesBufferPop ( void)
+uint8_t* messagesBufferPopCtx ( protocol_ctx_t* ctx )
 {
   uint8_t* raw_data = NULL;
-  uint16_t i;
-  uint16_t l = buffered_message_length();
+  uint16_t l = buffered_message_length(ctx);
 
-  if (buffer_status==BUFFER_MSG_OK){
+  if (ctx->buffer_status==BUFFER_MSG_OK){
     raw_data = (uint8_t*) malloc (l*sizeof(uint8_t));
     if (raw_data ==NULL)
-    {
-      buffer_status = BUFFER_NOT_SOF;
-    }
+      messagesBufferReleaseCtx(ctx);
     else
-    {
-      for(i=0;i<l;i++){
-        *(raw_data+i) = raw_rx_buffer[raw_rx_buffer_out_index++];
-        raw_rx_buffer_out_index %= RAW_RX_BUFFER_SIZE;
-      }
-      // raw_rx_buffer_out_index points to checksum now...
-      //so, advance the buffer after checksum and eof bytes
-      raw_rx_buffer_out_index += 2;
-      raw_rx_buffer_out_index %= RAW_RX_BUFFER_SIZE;
-      buffer_status = BUFFER_NOT_SOF;
-    }
+      messagesBufferPopIntoCtx(ctx, raw_data, l);
   }
   return raw_data;
 }
 
+/*
+ * copies the message into a caller owned buffer
+ * returns the message length, or 0 if there was no message to pop
+ *
+ * a buffer of MAX_MESSAGE_LENGTH bytes always fits a message.
+ * if the buffer is too small the message is discarded anyway.
+ * it never allocates memory
+*/
+uint16_t messagesBufferPopIntoCtx ( protocol_ctx_t* ctx, uint8_t* buffer, uint16_t size )
+{
+  uint16_t l = buffered_message_length(ctx);
+  uint16_t first;
+
+  if (ctx->buffer_status!=BUFFER_MSG_OK)
+    return 0;
 
-void messagesBufferClear ()
+  if (l > size){
+    messagesBufferReleaseCtx(ctx);
+    return 0;
+  }
+
+  if (ctx->framing_mode == FRAMING_COBS){
+    // already decoded out of the ring
+    memcpy(buffer, ctx->cobs_frame, l);
+    messagesBufferReleaseCtx(ctx);
+    return l;
+  }
+
+  // the message may wrap around the end of the ring
+  first = RAW_RX_BUFFER_SIZE - ctx->raw_rx_buffer_out_index;
+  if (first > l)
+    first = l;
+  memcpy(buffer, ctx->raw_rx_buffer + ctx->raw_rx_buffer_out_index, first);
+  memcpy(buffer + first, ctx->raw_rx_buffer, l - first);
+
+  messagesBufferReleaseCtx(ctx);
+  return l;
+}
+
+/*
+ * returns a pointer to the message inside the buffer, without copying it
+ * and sets length to the message length.
+ * it returns NULL if there is no message to pop, or if the message wraps
+ * around the end of the buffer (use messagesBufferPopIntoCtx then).
+ *
+ * the message stays in the buffer until messagesBufferReleaseCtx is called.
+ * the pointer is not aligned, see protocol.h
+*/
+uint8_t* messagesBufferPeekCtx ( protocol_ctx_t* ctx, uint16_t* length )
+{
+  uint16_t l = buffered_message_length(ctx);
+
+  if (ctx->buffer_status==BUFFER_MSG_OK && ctx->framing_mode == FRAMING_COBS){
+    *length = l;
+    return ctx->cobs_frame;
+  }
+
+  if (ctx->buffer_status!=BUFFER_MSG_OK
+      || ctx->raw_rx_buffer_out_index + l > RAW_RX_BUFFER_SIZE)
+    return NULL;
+
+  *length = l;
+  return ctx->raw_rx_buffer + ctx->raw_rx_buffer_out_index;
+}
+
+/*
+ * discards the message ready to pop, if any
+*/
+void messagesBufferReleaseCtx ( protocol_ctx_t* ctx )
 {
-  raw_rx_buffer_out_index = raw_rx_buffer_in_index;
-  buffer_status = BUFFER_NOT_SOF;
+  if (ctx->buffer_status!=BUFFER_MSG_OK)
+    return;
+
+  if (ctx->framing_mode == FRAMING_COBS){
+    // its bytes were consumed from the ring while decoding
+    reset_cobs_frame(ctx);
+    ctx->buffer_status = BUFFER_NOT_SOF;
+    return;
+  }
+
+  //advance the buffer after message, checksum and eof bytes
+  ctx->raw_rx_buffer_out_index += buffered_message_length(ctx) + protocolChecksumSize(ctx->integrity_mode) + 1;
+  ctx->raw_rx_buffer_out_index %= RAW_RX_BUFFER_SIZE;
+  ctx->buffer_status = BUFFER_NOT_SOF;
+}
+
+
+void messagesBufferClearCtx ( protocol_ctx_t* ctx )
+{
+  ctx->raw_rx_buffer_out_index = ctx->raw_rx_buffer_in_index;
+  ctx->buffer_status = BUFFER_NOT_SOF;
+  reset_cobs_frame(ctx);
 }
 
-static int raw_rx_buffer_count()
+static int raw_rx_buffer_count(protocol_ctx_t* ctx)
 {
-  return ( RAW_RX_BUFFER_SIZE + raw_rx_buffer_in_index - raw_rx_buffer_out_index ) % RAW_RX_BUFFER_SIZE;
+  return ( RAW_RX_BUFFER_SIZE + ctx->raw_rx_buffer_in_index - ctx->raw_rx_buffer_out_index ) % RAW_RX_BUFFER_SIZE;
+}
+
+/*
+ * discards buffered bytes up to the next START_OF_FRAME (or all of them)
+ * the buffer is searched in its (up to two) contiguous segments with memchr,
+ * which is vectorized by the C library, instead of byte by byte
+*/
+static void skip_to_start_of_frame(protocol_ctx_t* ctx)
+{
+  int count = raw_rx_buffer_count(ctx);
+
+  while(count>0)
+  {
+    uint8_t* segment = ctx->raw_rx_buffer + ctx->raw_rx_buffer_out_index;
+    int segment_length = RAW_RX_BUFFER_SIZE - ctx->raw_rx_buffer_out_index;
+    uint8_t* sof;
+    int skipped;
+
+    if(segment_length > count)
+      segment_length = count;
+
+    sof = (uint8_t*) memchr(segment, START_OF_FRAME, segment_length);
+    skipped = sof != NULL ? (int) (sof - segment) : segment_length;
+
+    ctx->raw_rx_buffer_out_index = ( ctx->raw_rx_buffer_out_index + skipped ) % RAW_RX_BUFFER_SIZE;
+    ctx->unframed_data_count += skipped;
+    count -= skipped;
+
+    if(sof != NULL)
+      return;
+  }
 }
 
 /*
  * returns buffer index
  * being raw_rx_buffer_out_index the 0th element
 */
-static int raw_rx_buffer_pos(int i)
+static int raw_rx_buffer_pos(protocol_ctx_t* ctx, int i)
 {
-  return ( raw_rx_buffer_out_index + i ) % RAW_RX_BUFFER_SIZE;
+  return ( ctx->raw_rx_buffer_out_index + i ) % RAW_RX_BUFFER_SIZE;
 }
 
 /*
  * returns the i-th element of the buffer
  * being raw_rx_buffer_out_index the 0th element
 */
-static uint8_t raw_rx_buffer_at(int i)
+static uint8_t raw_rx_buffer_at(protocol_ctx_t* ctx, int i)
 {
-  return raw_rx_buffer[raw_rx_buffer_pos(i)];
+  return ctx->raw_rx_buffer[raw_rx_buffer_pos(ctx, i)];
 }
 
 
@@ -134,29 +457,22 @@ static uint8_t raw_rx_buffer_at(int i)
  * returns the message length
  * caution! only valid if buffer status
  * is BUFFER_IN_MSG or BUFFER_EOF
+ * it was decoded when the message entered BUFFER_IN_MSG
 */
-static uint16_t buffered_message_data_length()
+static uint16_t buffered_message_data_length(protocol_ctx_t* ctx)
 {
-
-  uint8_t i;
-  uint16_t length;
-
-  if (buffer_status!=BUFFER_EOF
-      && buffer_status!=BUFFER_IN_MSG
-      && buffer_status!=BUFFER_MSG_OK)
+  if (ctx->buffer_status!=BUFFER_EOF
+      && ctx->buffer_status!=BUFFER_IN_MSG
+      && ctx->buffer_status!=BUFFER_MSG_OK)
     return 0;
 
-  for(i=0;i<sizeof(uint16_t);i++)
-    *( ((uint8_t*) &length )+i) = raw_rx_buffer_at(i);
-
-  //msg length is the first two bytes
-  return length;
+  return ctx->message_data_length;
 }
 
 
-static int buffered_message_length()
+static int buffered_message_length(protocol_ctx_t* ctx)
 {
-  return sizeof(message_hdr_t) + buffered_message_data_length();
+  return sizeof(message_hdr_t) + buffered_message_data_length(ctx);
 }
 
 
@@ -166,10 +482,10 @@ static int buffered_message_length()
  * is BUFFER_EOF
  * returns 1 if valid EOF, 0 otherwise
 */
-static int validate_end_of_frame()
+static int validate_end_of_frame(protocol_ctx_t* ctx)
 {
 
-  return raw_rx_buffer_at(buffered_message_length()+1) == END_OF_FRAME;
+  return raw_rx_buffer_at(ctx, buffered_message_length(ctx) + protocolChecksumSize(ctx->integrity_mode)) == END_OF_FRAME;
 }
 
 /*
@@ -179,20 +495,52 @@ static int validate_end_of_frame()
  * returns 1 if valid checksum, 0 otherwise
  * note: differs from validateChecksum from being
  * a raw checksum (not a message_t struct but an array)
+ * the checksum was already calculated while the message arrived
 */
 
-static uint8_t validate_buffer_checksum()
+static uint8_t validate_buffer_checksum(protocol_ctx_t* ctx)
 {
-  uint8_t calculated_checksum = 0;
-  int i;
+  uint32_t received = 0;
+  uint8_t i;
 
-  if (buffer_status!=BUFFER_EOF)
+  if (ctx->buffer_status!=BUFFER_EOF)
     return 0;
 
-  for(i = 0; i < buffered_message_length() ; i++)
-    calculated_checksum ^= raw_rx_buffer_at(i);
+  // little endian, protocolChecksumSize bytes long
+  for(i = 0; i < protocolChecksumSize(ctx->integrity_mode); i++)
+    received |= (uint32_t) raw_rx_buffer_at(ctx, buffered_message_length(ctx) + i) << (8 * i);
+
+  return received == protocolChecksumFinal(ctx->integrity_mode, ctx->running_checksum);
+}
+
+/*
+ * folds the message bytes received since last call into running_checksum
+ * caution! only valid if buffer status
+ * is BUFFER_IN_MSG
+*/
+static void update_buffer_checksum(protocol_ctx_t* ctx)
+{
+  int available = raw_rx_buffer_count(ctx);
+  uint32_t checksum = ctx->running_checksum;
+
+  if(available > buffered_message_length(ctx))
+    available = buffered_message_length(ctx);
+
+  // walk the ring by contiguous segments, no modulo per byte
+  while(ctx->checked_count < available)
+  {
+    int pos = raw_rx_buffer_pos(ctx, ctx->checked_count);
+    int end = pos + available - ctx->checked_count;
+
+    if(end > RAW_RX_BUFFER_SIZE)
+      end = RAW_RX_BUFFER_SIZE;
 
-  return raw_rx_buffer_at(buffered_message_length()) == calculated_checksum;
+    checksum = protocolChecksumUpdate(ctx->integrity_mode, checksum, ctx->raw_rx_buffer + pos, end - pos);
+
+    ctx->checked_count += end - pos;
+  }
+
+  ctx->running_checksum = checksum;
 }
 
 
@@ -206,84 +554,291 @@ static uint8_t validate_buffer_checksum()
  * note: function wont have any effect if status==BUFFER_MSG_OK until
  * the message is poped from buffer
 */
-buffer_status_t messagesBufferProcess ( void)
+buffer_status_t messagesBufferProcessCtx ( protocol_ctx_t* ctx )
 {
 
   //check if an error ocurred last time
-  if(buffer_status==BUFFER_ERROR_SOF_EXPECTED
-     || buffer_status==BUFFER_ERROR_INVALID_MSG_LENGTH
-     || buffer_status==BUFFER_ERROR_EOF_EXPECTED
-     || buffer_status==BUFFER_ERROR_CHECKSUM )
+  if(ctx->buffer_status==BUFFER_ERROR_SOF_EXPECTED
+     || ctx->buffer_status==BUFFER_ERROR_INVALID_MSG_LENGTH
+     || ctx->buffer_status==BUFFER_ERROR_EOF_EXPECTED
+     || ctx->buffer_status==BUFFER_ERROR_CHECKSUM )
   {
-    //an error ocurred before... then, clear the buffer and reset status
-    messagesBufferClear();
-  }
-
+    ctx->resync_count++;
 
-  if(buffer_status==BUFFER_NOT_SOF){
-    while(raw_rx_buffer_count()>0 && raw_rx_buffer_at(0) != START_OF_FRAME)
+    if(ctx->resync_mode == RESYNC_NEXT_SOF)
+    {
+      // the failed SOF was already consumed, so the search starts right after it.
+      // frames buffered behind the broken one are kept
+      // (with COBS, the failed frame's delimiter was consumed)
+      ctx->unframed_data_count = 0;
+      ctx->buffer_status = BUFFER_NOT_SOF;
+      reset_cobs_frame(ctx);
+    }
+    else
     {
-      raw_rx_buffer_out_index++;
-      unframed_data_count++;
+      //an error ocurred before... then, clear the buffer and reset status
+      messagesBufferClearCtx(ctx);
     }
+  }
+
+  if(ctx->framing_mode == FRAMING_COBS)
+    return process_cobs_frame(ctx);
+
 
-    if (raw_rx_buffer_at(0) == START_OF_FRAME)
+  if(ctx->buffer_status==BUFFER_NOT_SOF){
+    skip_to_start_of_frame(ctx);
+
+    // an empty buffer holds stale data only
+    if (raw_rx_buffer_count(ctx)>0 && raw_rx_buffer_at(ctx, 0) == START_OF_FRAME)
     {
-      unframed_data_count = 0;
-      raw_rx_buffer[raw_rx_buffer_out_index] = 0; //read it only once
-      raw_rx_buffer_out_index++; //discard SOF byte
-      buffer_status = BUFFER_SOF;
+      ctx->unframed_data_count = 0;
+      ctx->raw_rx_buffer[ctx->raw_rx_buffer_out_index] = 0; //read it only once
+      ctx->raw_rx_buffer_out_index++; //discard SOF byte
+      ctx->raw_rx_buffer_out_index %= RAW_RX_BUFFER_SIZE;
+      ctx->buffer_status = BUFFER_SOF;
     }
     else
     {
-      if(unframed_data_count>MAX_UNFRAMED_DATA)
+      if(ctx->unframed_data_count>MAX_UNFRAMED_DATA)
         // too much data buffered without a start of frame byte!
-        buffer_status = BUFFER_ERROR_SOF_EXPECTED;
+        ctx->buffer_status = BUFFER_ERROR_SOF_EXPECTED;
     }
   }
 
-  if(buffer_status==BUFFER_SOF) {
-    if(raw_rx_buffer_count()>=2)
+  if(ctx->buffer_status==BUFFER_SOF) {
+    if(raw_rx_buffer_count(ctx)>=2)
+    {
       // buffer count should at least be 2 to read message length
-      buffer_status = BUFFER_IN_MSG;
+      // it is the first two bytes, decode it only once
+      ctx->message_data_length = raw_rx_buffer_at(ctx, 0) | ( raw_rx_buffer_at(ctx, 1) << 8 );
+      ctx->checked_count = 0;
+      ctx->running_checksum = protocolChecksumInit(ctx->integrity_mode);
+      ctx->buffer_status = BUFFER_IN_MSG;
+
+      // a longer message would never fit the buffer nor the caller's
+      if(buffered_message_data_length(ctx) > MAX_MESSAGE_DATA_LENGTH)
+        ctx->buffer_status = BUFFER_ERROR_INVALID_MSG_LENGTH;
+    }
   }
 
-  if(buffer_status==BUFFER_IN_MSG) {
-    if(raw_rx_buffer_count() >= buffered_message_length()  + 2)
-      //if buffer length is more than message header + data length + checksum byte + eof byte
+  if(ctx->buffer_status==BUFFER_IN_MSG) {
+    update_buffer_checksum(ctx);
+
+    if(raw_rx_buffer_count(ctx) >= buffered_message_length(ctx) + protocolChecksumSize(ctx->integrity_mode) + 1)
+      //if buffer length is more than message header + data length + checksum bytes + eof byte
       //then, frame should be ended
-      buffer_status = BUFFER_EOF;
+      ctx->buffer_status = BUFFER_EOF;
   }
 
-  if(buffer_status==BUFFER_EOF) {
+  if(ctx->buffer_status==BUFFER_EOF) {
     //we have a full message buffered
     //let's validate checksum and eof byte
 
 
-    if(!validate_end_of_frame())
+    if(!validate_end_of_frame(ctx))
     {
       // seems message lacks of EOF where expected
-      buffer_status = BUFFER_ERROR_EOF_EXPECTED;
+      ctx->buffer_status = BUFFER_ERROR_EOF_EXPECTED;
     }
     else
     {
       //only validate checksum if EOF is valid
-      if(!validate_buffer_checksum())
+      if(!validate_buffer_checksum(ctx))
       {
         //checksum sent and calculated does not match!
-        buffer_status = BUFFER_ERROR_CHECKSUM;
+        ctx->buffer_status = BUFFER_ERROR_CHECKSUM;
       }
       else{
         //valid EOF and checksum
         //message is ready to pop!
-        buffer_status = BUFFER_MSG_OK;
+        ctx->buffer_status = BUFFER_MSG_OK;
       }
     }
 
   }
 
   //return the process status
-  return buffer_status;
+  return ctx->buffer_status;
+}
+
+static void reset_cobs_frame(protocol_ctx_t* ctx)
+{
+  ctx->cobs_length = 0;
+  ctx->cobs_code = 0;
+  ctx->cobs_remaining = 0;
+  ctx->cobs_skip = 0;
+  ctx->checked_count = 0;
+  ctx->running_checksum = protocolChecksumInit(ctx->integrity_mode);
+}
+
+/*
+ * messagesBufferProcessCtx for FRAMING_COBS
+ * decodes the buffered bytes into cobs_frame, consuming them from the ring,
+ * and validates the frame when its delimiter arrives.
+ * the checksum is folded in as the frame is decoded
+*/
+static buffer_status_t process_cobs_frame(protocol_ctx_t* ctx)
+{
+  int count = raw_rx_buffer_count(ctx);
+  uint8_t checksum_size = protocolChecksumSize(ctx->integrity_mode);
+  int delimiter_found = 0;
+  uint16_t data_length;
+  uint32_t received = 0;
+  uint8_t i;
+
+  if(ctx->buffer_status == BUFFER_MSG_OK)
+    return ctx->buffer_status; // pop it first
+
+  while(count > 0 && !delimiter_found)
+  {
+    uint8_t* segment = ctx->raw_rx_buffer + ctx->raw_rx_buffer_out_index;
+    int segment_length = RAW_RX_BUFFER_SIZE - ctx->raw_rx_buffer_out_index;
+    int n;
+
+    if(segment_length > count)
+      segment_length = count;
+
+    for(n = 0; n < segment_length; n++)
+    {
+      uint8_t data = segment[n];
+
+      if(data == COBS_DELIMITER)
+      {
+        delimiter_found = 1;
+        n++;
+        break;
+      }
+
+      if(ctx->cobs_skip)
+        continue;
+
+      if(ctx->cobs_remaining == 0)
+      {
+        // a new block: the previous one ended with an implicit zero, unless it was full
+        int implicit_zero = ctx->cobs_code != 0 && ctx->cobs_code != 0xFF;
+
+        ctx->cobs_code = data;
+        ctx->cobs_remaining = data - 1;
+        if(!implicit_zero)
+          continue;
+        data = 0;
+      }
+      else
+      {
+        ctx->cobs_remaining--;
+      }
+
+      if(ctx->cobs_length >= sizeof(ctx->cobs_frame))
+      {
+        ctx->cobs_skip = 1;
+        continue;
+      }
+      ctx->cobs_frame[ctx->cobs_length++] = data;
+    }
+
+    ctx->raw_rx_buffer_out_index = ( ctx->raw_rx_buffer_out_index + n ) % RAW_RX_BUFFER_SIZE;
+    count -= n;
+  }
+
+  // fold what is surely not the checksum
+  if(!ctx->cobs_skip && ctx->cobs_length > checksum_size + ctx->checked_count)
+  {
+    ctx->running_checksum = protocolChecksumUpdate(ctx->integrity_mode, ctx->running_checksum,
+                                                   ctx->cobs_frame + ctx->checked_count,
+                                                   ctx->cobs_length - checksum_size - ctx->checked_count);
+    ctx->checked_count = ctx->cobs_length - checksum_size;
+  }
+
+  if(!delimiter_found)
+  {
+    ctx->buffer_status = (ctx->cobs_code != 0) ? BUFFER_IN_MSG : BUFFER_NOT_SOF;
+    return ctx->buffer_status;
+  }
+
+  if(ctx->cobs_skip || ctx->cobs_length < sizeof(message_hdr_t) + checksum_size)
+  {
+    if(ctx->cobs_code == 0)
+    {
+      // empty frame (consecutive delimiters)
+      ctx->buffer_status = BUFFER_NOT_SOF;
+      return ctx->buffer_status;
+    }
+    ctx->buffer_status = BUFFER_ERROR_INVALID_MSG_LENGTH;
+    return ctx->buffer_status;
+  }
+
+  if(ctx->cobs_remaining != 0)
+  {
+    // the delimiter arrived in the middle of a block
+    ctx->buffer_status = BUFFER_ERROR_EOF_EXPECTED;
+    return ctx->buffer_status;
+  }
+
+  // the length field must match the actual frame
+  data_length = ctx->cobs_frame[0] | ( ctx->cobs_frame[1] << 8 );
+  if(sizeof(message_hdr_t) + data_length + checksum_size != ctx->cobs_length)
+  {
+    ctx->buffer_status = BUFFER_ERROR_INVALID_MSG_LENGTH;
+    return ctx->buffer_status;
+  }
+
+  for(i = 0; i < checksum_size; i++)
+    received |= (uint32_t) ctx->cobs_frame[ctx->cobs_length - checksum_size + i] << (8 * i);
+
+  if(received != protocolChecksumFinal(ctx->integrity_mode, ctx->running_checksum))
+  {
+    ctx->buffer_status = BUFFER_ERROR_CHECKSUM;
+    return ctx->buffer_status;
+  }
+
+  ctx->message_data_length = data_length;
+  ctx->buffer_status = BUFFER_MSG_OK;
+  return ctx->buffer_status;
+}
+
+void cobsEncoderInit(cobs_encoder_t* encoder, uint8_t* out)
+{
+  encoder->out = out;
+  encoder->code_index = 0;
+  encoder->length = 1;
+  encoder->code = 1;
+}
+
+/*
+ * encodes length bytes of data into the encoder output
+ * can be called several times for the same frame
+*/
+void cobsEncoderUpdate(cobs_encoder_t* encoder, const uint8_t* data, size_t length)
+{
+  const uint8_t* end = data + length;
+
+  for(; data < end; data++)
+  {
+    if(*data != 0)
+    {
+      encoder->out[encoder->length++] = *data;
+      encoder->code++;
+    }
+
+    if(*data == 0 || encoder->code == 0xFF)
+    {
+      // close the block
+      encoder->out[encoder->code_index] = encoder->code;
+      encoder->code_index = encoder->length++;
+      encoder->code = 1;
+    }
+  }
+}
+
+/*
+ * closes the frame and appends the delimiter
+ * returns the frame length, at most COBS_MAX_ENCODED_LENGTH of the data length
+*/
+size_t cobsEncoderFinish(cobs_encoder_t* encoder)
+{
+  encoder->out[encoder->code_index] = encoder->code;
+  encoder->out[encoder->length++] = COBS_DELIMITER;
+  return encoder->length;
 }
 
 uint8_t* messageData(message_hdr_t* message)
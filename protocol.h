@@ -41,12 +41,34 @@
     * Handshaking is done with a handshake message.
     * A successful connection with the Device is established after a succesful handshake message response.
     * A message (other than a handshake) should not be sent before a successful connection is established.
+    * The handshake also negotiates the integrity check (see Checksum) and the framing
+      (see COBS Framing). A device goes back to XOR and SOF/EOF when it has not received a
+      valid frame for a while, like the client does when the device stops responding,
+      so both ends can always find each other again.
+    * Timing contract for that reset (see the LINK_* defines), in ms since the last valid frame:
+        - the client probes an idle link at most every LINK_MAX_IDLE_PROBE_MS (2500),
+        - the client declares the device lost after LINK_DEAD_MS (5000) and goes back to
+          legacy modes, sending legacy handshakes from then on,
+        - so the device must reset after more than 2500 ms, or a healthy idle link would
+          be reset between probes, and less than 5000 ms, or the legacy handshakes would
+          arrive while it still expects the negotiated modes. 4000 ms is a good value.
 
   Checksum:
   ---------
     * After a message, a checksum is sent, being its value a byte XOR of the message struct and data.
     * The checksum will always be the byte before EOF of messages for easing checksum verification.
     * A checksum verification should be made upon message arrival.
+    * Newer devices may use a CRC-16-CCITT (2 bytes) or CRC-32 (4 bytes) instead, little endian.
+      The handshake request carries a handshake_data_t with the modes the client supports,
+      and the response the mode to use from then on. A bodyless response means XOR.
+
+  COBS Framing:
+  -------------
+    * Negotiated in the handshake as well (framing field of handshake_data_t).
+    * msg_struct and checksum are COBS encoded and followed by a single 0x00 byte,
+      with no SOF/EOF. A 0x00 can only be a frame delimiter, so a broken frame never
+      hides the next one and the length field is checked against the real frame size.
+    * Overhead is one byte every 254, plus the delimiter.
 
   Message ID:
   -----------
@@ -57,12 +79,46 @@
       when the corresponding response has arrived.
     * This limits up to sizeof(msg_id) simultaneous messsages, so qt client wont enqueu a new
       message until there is space for it.
+    * Legacy devices handle LEGACY_MSG_WINDOW requests in flight, with msg_id below it.
+      The handshake request carries the window the client wants (window field of
+      handshake_data_t) and the response the one the device accepts, up to MAX_MSG_WINDOW.
+      With a negotiated window any msg_id can be used, and the client hands them out
+      round-robin so a late response is not taken for the answer to a newer request.
 
   Timeouts:
   ------------
     * A timeout exception should be implemented on qt client side for each message sent.
     * A timeout exception should be implemented on device side for receiving chuncked messages.
 
+  Liveness:
+  ---------
+    * Any valid frame proves the other end is alive, so nothing extra is sent while the
+      link is busy. The client only probes after a configurable time without frames.
+    * If both ends set FEATURE_HEARTBEAT in the handshake, probes are MESSAGE_HEARTBEAT
+      messages instead of handshakes: bodyless, msg_id is always 0 and takes no slot.
+      A heartbeat request is answered with a heartbeat response. Otherwise probes are
+      handshake requests, as with legacy devices.
+
+  Streaming uploads:
+  ------------------
+    * If both ends set FEATURE_STREAMING in the handshake, a file can be uploaded while it is
+      still being produced (eg. converted), when its length is not known yet.
+    * The FILEHEADER is sent with length and chunks_count 0. The device places the file at
+      block_start as usual, with all the free blocks after it available.
+    * Chunks follow as their data is ready. All of them are FILECHUNK_SIZE bytes but the last one.
+    * When the data ends and every chunk was answered, the same FILEHEADER is sent again with
+      the final length and chunks_count. The device answers STATUS_OK and adds the file to its
+      list only if it has all of those chunks, otherwise STATUS_ERROR and the file is dropped.
+
+  Deduplication:
+  --------------
+    * content_hash in fileheader_data_t is the FNV-1a 64 hash of the audio (contentHashUpdate),
+      0 when the client does not give it. Devices store it with the file.
+    * If both ends set FEATURE_DEDUP in the handshake, the client fills it in every FILEHEADER
+      with a length (the final one of a streaming upload). When the device already stores a file
+      with the same hash, length and sample_rate, it answers STATUS_ALREADY_STORED and no chunk
+      is sent: under another name the file is added to the list, sharing the stored blocks.
+
   Status responses:
   -----------------
     * Every response message will have status_id indicating possible errors.
@@ -85,6 +141,7 @@
     * Rewrite functions to allow multiple bytes for
       START_OF_FRAME, checksum and END_OF_FRAME
     * Make the client handle memory instead of allocating memory here.
+      (done: see messagesBufferPopIntoCtx and messagesBufferPeekCtx)
 
 
 
@@ -101,7 +158,25 @@
 #define START_OF_FRAME 0xFA
 #define END_OF_FRAME 0xCC
 #define RAW_RX_BUFFER_SIZE 1024
+// shared with the device firmware. it can be changed at build time (DEFINES += FILECHUNK_SIZE=256)
+// to compare chunk sizes, both ends must agree. a whole frame must fit in RAW_RX_BUFFER_SIZE
+#ifndef FILECHUNK_SIZE
 #define FILECHUNK_SIZE  512
+#endif
+// biggest message is a FILECHUNK: message_hdr_t + chunk_id + chunk data
+#define MAX_MESSAGE_DATA_LENGTH (4 + FILECHUNK_SIZE)
+#define MAX_MESSAGE_LENGTH (4 + MAX_MESSAGE_DATA_LENGTH)
+#define MAX_CHECKSUM_SIZE 4
+#define LEGACY_MSG_WINDOW 16
+#define MAX_MSG_WINDOW 255
+#define COBS_DELIMITER 0x00
+// COBS adds a code byte every 254 bytes, plus the delimiter
+#define COBS_MAX_ENCODED_LENGTH(length) ((length) + (length) / 254 + 2)
+// biggest frame on the wire, for any framing mode
+#define MAX_FRAME_LENGTH COBS_MAX_ENCODED_LENGTH(MAX_MESSAGE_LENGTH + MAX_CHECKSUM_SIZE)
+// link reset bounds, see Handshaking: LINK_MAX_IDLE_PROBE_MS < device reset < LINK_DEAD_MS
+#define LINK_DEAD_MS 5000
+#define LINK_MAX_IDLE_PROBE_MS (LINK_DEAD_MS / 2)
 
 
 
@@ -132,7 +207,8 @@ End of Multi Language Header
 
 typedef enum {
   STATUS_OK,
-  STATUS_ERROR
+  STATUS_ERROR,
+  STATUS_ALREADY_STORED, // FILEHEADER only, with FEATURE_DEDUP: see Deduplication
 } status_id_t;
 
 typedef enum {
@@ -141,9 +217,35 @@ typedef enum {
   MESSAGE_COMMAND,
   MESSAGE_FILEHEADER,
   MESSAGE_FILECHUNK,
+  MESSAGE_HEARTBEAT, // only with FEATURE_HEARTBEAT, see Liveness
   MESSAGE_MAX_VALID_TYPE,
 } message_type_t;
 
+// checksum sent before EOF, see integrity_mode_t flags in handshake_data_t
+typedef enum {
+  INTEGRITY_XOR,   // 1 byte XOR (legacy)
+  INTEGRITY_CRC16, // CRC-16-CCITT, poly 0x1021, init 0xFFFF
+  INTEGRITY_CRC32, // CRC-32 (IEEE 802.3)
+  INTEGRITY_MAX_VALID_MODE,
+} integrity_mode_t;
+
+#define INTEGRITY_FLAG(mode) (1 << (mode))
+
+typedef enum {
+  FRAMING_SOF_EOF, // SOF + message + checksum + EOF (legacy)
+  FRAMING_COBS,    // COBS(message + checksum) + COBS_DELIMITER
+  FRAMING_MAX_VALID_MODE,
+} framing_mode_t;
+
+#define FRAMING_FLAG(mode) (1 << (mode))
+
+// optional features, flags in the features field of handshake_data_t
+typedef enum {
+  FEATURE_HEARTBEAT = 0x01, // MESSAGE_HEARTBEAT probes
+  FEATURE_STREAMING = 0x02, // uploads of unknown length, see Streaming uploads
+  FEATURE_DEDUP = 0x04,     // FILEHEADER answered STATUS_ALREADY_STORED, see Deduplication
+} feature_flag_t;
+
 typedef enum{
   BUFFER_NOT_SOF, // not start of frame
   BUFFER_SOF,     // start of frame
@@ -156,6 +258,12 @@ typedef enum{
   BUFFER_ERROR_INVALID_MSG_LENGTH,
 } buffer_status_t;
 
+// what the parser does after a BUFFER_ERROR_* status
+typedef enum{
+  RESYNC_CLEAR,    // discard everything buffered (legacy)
+  RESYNC_NEXT_SOF, // search the next SOF right after the failed one, keep the rest
+} resync_mode_t;
+
 
 
 typedef enum {
@@ -188,9 +296,11 @@ typedef struct
   uint32_t chunks_count;
   uint32_t block_start; // indice de bloque de la SD donde comienza el audio del archivo
   uint32_t sample_rate;
-  uint32_t RESERVED0[2]; // para alinear de a 32 bytes
+  uint32_t content_hash[2]; // hash del audio, palabra baja primero. 0: sin hash. alinea de a 32 bytes
 } fileheader_data_t;
 
+#define CONTENT_HASH_INIT 0xcbf29ce484222325ULL
+
 typedef struct
 {
   uint8_t files_count;
@@ -205,16 +315,98 @@ typedef struct
   uint32_t  chunk_id;
 } filechunk_hdr_t;
 
+typedef struct
+{
+  // request: INTEGRITY_FLAG of every supported mode (always including XOR)
+  // response: the integrity_mode_t to use
+  uint8_t integrity;
+  // request: FRAMING_FLAG of every supported mode (always including SOF_EOF)
+  // response: the framing_mode_t to use
+  uint8_t framing;
+  // request: requests the client can keep in flight
+  // response: requests the device accepts in flight, 0 for LEGACY_MSG_WINDOW
+  uint8_t window;
+  // request: every feature_flag_t the client supports
+  // response: the ones enabled
+  uint8_t features;
+} handshake_data_t;
+
+// builds a COBS frame from several pieces of data
+typedef struct
+{
+  uint8_t* out;
+  size_t length;     // bytes written to out so far
+  size_t code_index; // where the code byte of the current block goes
+  uint8_t code;
+} cobs_encoder_t;
+
+/*
+ * state of a frame parser (one per serial stream)
+ * messagesBuffer*Ctx functions work on it, so several streams
+ * can be parsed at once, even from different threads.
+ * a zeroed context is a valid initial state
+*/
+typedef struct
+{
+  uint8_t raw_rx_buffer[RAW_RX_BUFFER_SIZE];
+  int raw_rx_buffer_in_index;
+  int raw_rx_buffer_out_index;
+  int unframed_data_count;
+  buffer_status_t buffer_status;
+  resync_mode_t resync_mode;
+  uint32_t resync_count; // errors recovered from so far
+  integrity_mode_t integrity_mode;
+  framing_mode_t framing_mode;
+  // of the message being received, updated as its bytes arrive
+  uint16_t message_data_length; // decoded once, when BUFFER_IN_MSG is reached
+  int checked_count;            // bytes already folded into running_checksum
+  uint32_t running_checksum;
+  // COBS framing only: the frame is decoded here as it arrives
+  uint8_t cobs_frame[MAX_MESSAGE_LENGTH + MAX_CHECKSUM_SIZE];
+  uint16_t cobs_length;
+  uint8_t cobs_code;      // code byte of the current block, 0 before the first one
+  uint8_t cobs_remaining; // bytes left in the current block
+  uint8_t cobs_skip;      // frame too long: ignore it up to the delimiter
+} protocol_ctx_t;
+
 
 
 //utility functions:
 uint8_t messageGetChecksum(message_hdr_t* message, uint8_t* data);
+uint32_t messageGetIntegrity(integrity_mode_t mode, message_hdr_t* message, uint8_t* data);
+uint8_t protocolChecksumSize(integrity_mode_t mode);
+uint32_t protocolChecksumInit(integrity_mode_t mode);
+uint32_t protocolChecksumUpdate(integrity_mode_t mode, uint32_t state, const uint8_t* data, size_t length);
+uint32_t protocolChecksumFinal(integrity_mode_t mode, uint32_t state);
+uint64_t contentHashUpdate(uint64_t hash, const uint8_t* data, size_t length);
+uint64_t fileheaderContentHash(const fileheader_data_t* header);
+void fileheaderSetContentHash(fileheader_data_t* header, uint64_t hash);
+void cobsEncoderInit(cobs_encoder_t* encoder, uint8_t* out);
+void cobsEncoderUpdate(cobs_encoder_t* encoder, const uint8_t* data, size_t length);
+size_t cobsEncoderFinish(cobs_encoder_t* encoder);
 buffer_status_t messagesBufferProcess ( void);
 void messagesBufferPush ( uint8_t data );
+size_t messagesBufferPushBlock ( const uint8_t* data, size_t length );
 uint8_t* messagesBufferPop( void);
 uint8_t* messageData(message_hdr_t* message);
 void messagesBufferClear();
 
+//same as above, but working on a given parser context
+void protocolCtxInit(protocol_ctx_t* ctx);
+void protocolCtxSetModes(protocol_ctx_t* ctx, integrity_mode_t integrity, framing_mode_t framing);
+buffer_status_t messagesBufferProcessCtx(protocol_ctx_t* ctx);
+void messagesBufferPushCtx(protocol_ctx_t* ctx, uint8_t data);
+size_t messagesBufferPushBlockCtx(protocol_ctx_t* ctx, const uint8_t* data, size_t length);
+uint8_t* messagesBufferPopCtx(protocol_ctx_t* ctx);
+uint16_t messagesBufferPopIntoCtx(protocol_ctx_t* ctx, uint8_t* buffer, uint16_t size);
+// the message is returned in place, right after its SOF: the pointer is NOT
+// aligned. copy the header (and any field wider than a byte) out with memcpy
+// instead of reading it through a message_hdr_t* or other struct cast.
+// messagesBufferPopIntoCtx into a 4 byte aligned buffer has no such limit
+uint8_t* messagesBufferPeekCtx(protocol_ctx_t* ctx, uint16_t* length);
+void messagesBufferReleaseCtx(protocol_ctx_t* ctx);
+void messagesBufferClearCtx(protocol_ctx_t* ctx);
+
 
 /*END OF C/C++ COMMON CODE - (do not code below this line)*/
 
@@ -0,0 +1,213 @@
+#include "resampler.h"
+#include <math.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define RESAMPLER_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLER_NEON
+#endif
+
+const float PolyphaseResampler::CUTOFF = 0.92f;
+const float PolyphaseResampler::KAISER_BETA = 8.0f;
+
+PolyphaseResampler::PolyphaseResampler()
+{
+  configure(1, 1);
+}
+
+void PolyphaseResampler::configure(int inputRate, int outputRate)
+{
+  int a = inputRate;
+  int b = outputRate;
+  while(b != 0)
+  {
+    int r = a % b;
+    a = b;
+    b = r;
+  }
+
+  m_inputRate = inputRate;
+  m_outputRate = outputRate;
+  m_up = outputRate / a;
+  m_down = inputRate / a;
+  m_phases = m_up < MAX_PHASES ? m_up : MAX_PHASES;
+  m_position = 0;
+  m_inputCount = 0;
+  m_outputCount = 0;
+  m_filter.clear();
+  m_history.clear();
+
+  if(m_up == m_down)
+  {
+    m_taps = 0; // passed through as it is
+    return;
+  }
+
+  // cutoff relative to the input Nyquist frequency, the filter gets longer as it goes down
+  double ratio = qMin(1.0, (double) m_up / m_down);
+  double cutoff = ratio * CUTOFF;
+  int half = (int) ceil(ZERO_CROSSINGS / ratio);
+  m_taps = (2 * half + 7) & ~7;
+  half = m_taps / 2;
+
+  m_filter.resize(m_phases * m_taps);
+  for(int phase = 0; phase < m_phases; phase++)
+  {
+    float* row = m_filter.data() + phase * m_taps;
+    double frac = (double) phase / m_phases;
+    double sum = 0;
+
+    for(int k = 0; k < m_taps; k++)
+    {
+      // from the input sample of tap k to where the output falls
+      double d = frac - (k - half + 1);
+      double x = d / half;
+      double window = fabs(x) < 1 ? besselI0(KAISER_BETA * sqrt(1 - x * x)) / besselI0(KAISER_BETA) : 0;
+      double sinc = d == 0 ? 1 : sin(M_PI * cutoff * d) / (M_PI * cutoff * d);
+      row[k] = cutoff * sinc * window;
+      sum += row[k];
+    }
+
+    // unity gain at DC on every phase, otherwise they ripple against each other
+    for(int k = 0; k < m_taps; k++)
+      row[k] /= sum;
+  }
+
+  // the first output is centered on the first input sample
+  m_history.fill(0, half - 1);
+}
+
+void PolyphaseResampler::process(const float* input, int count, QVector<float>& output)
+{
+  m_inputCount += count;
+
+  if(m_taps == 0)
+  {
+    output.reserve(output.size() + count);
+    for(int i = 0; i < count; i++)
+      output.append(input[i]);
+    m_outputCount += count;
+    return;
+  }
+
+  int first = m_history.size();
+  m_history.resize(first + count);
+  memcpy(m_history.data() + first, input, count * sizeof(float));
+  run(output, -1);
+}
+
+void PolyphaseResampler::flush(QVector<float>& output)
+{
+  if(m_taps == 0)
+    return;
+
+  // as many as the input lasts, the zeros only drain the filter
+  qint64 total = (m_inputCount * m_up + m_down - 1) / m_down;
+  m_history.insert(m_history.size(), m_taps / 2 + m_down / m_up + 1, 0.0f);
+  run(output, total);
+}
+
+int PolyphaseResampler::inputRate() const
+{
+  return m_inputRate;
+}
+
+int PolyphaseResampler::outputRate() const
+{
+  return m_outputRate;
+}
+
+void PolyphaseResampler::run(QVector<float>& output, qint64 outputLimit)
+{
+  const float* history = m_history.constData();
+  qint64 available = m_history.size();
+
+  output.reserve(output.size() + (available * m_up) / m_down + 1);
+
+  while(outputLimit < 0 || m_outputCount < outputLimit)
+  {
+    qint64 index = m_position / m_up;
+    if(index + m_taps > available)
+      break;
+
+    int phase = m_position % m_up;
+    if(m_phases != m_up)
+      phase = (int) ((qint64) phase * m_phases / m_up);
+
+    output.append(dot(history + index, m_filter.constData() + phase * m_taps, m_taps));
+    m_position += m_down;
+    m_outputCount++;
+  }
+
+  // input no output will need again
+  qint64 consumed = qMin(m_position / m_up, available);
+  if(consumed > 0)
+  {
+    m_history.remove(0, consumed);
+    m_position -= consumed * m_up;
+  }
+}
+
+/*
+ * count is a multiple of 8
+*/
+float PolyphaseResampler::dot(const float* a, const float* b, int count)
+{
+#if defined(RESAMPLER_SSE)
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  float sums[4];
+
+  for(int i = 0; i < count; i += 8)
+  {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  _mm_storeu_ps(sums, _mm_add_ps(sum0, sum1));
+  return sums[0] + sums[1] + sums[2] + sums[3];
+#elif defined(RESAMPLER_NEON)
+  float32x4_t sum0 = vdupq_n_f32(0);
+  float32x4_t sum1 = vdupq_n_f32(0);
+
+  for(int i = 0; i < count; i += 8)
+  {
+    sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+    sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  sum0 = vaddq_f32(sum0, sum1);
+  return vgetq_lane_f32(sum0, 0) + vgetq_lane_f32(sum0, 1) + vgetq_lane_f32(sum0, 2) + vgetq_lane_f32(sum0, 3);
+#else
+  // independent sums, so the compiler can still vectorize it
+  float sum[4] = {0, 0, 0, 0};
+
+  for(int i = 0; i < count; i += 4)
+    for(int j = 0; j < 4; j++)
+      sum[j] += a[i + j] * b[i + j];
+  return sum[0] + sum[1] + sum[2] + sum[3];
+#endif
+}
+
+/*
+ * modified Bessel function of the first kind, order 0, for the Kaiser window
+*/
+double PolyphaseResampler::besselI0(double x)
+{
+  double sum = 1;
+  double term = 1;
+
+  for(int k = 1; k < 32; k++)
+  {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if(term < sum * 1e-12)
+      break;
+  }
+  return sum;
+}
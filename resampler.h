@@ -0,0 +1,64 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <QVector>
+
+/*
+ * Converts mono audio from one sample rate to another with a polyphase
+ * windowed sinc filter, a block at a time.
+ * The ratio is kept exact as up / down (44100 -> 8000 is 80 / 441): every
+ * output sample is the dot product of m_taps input samples with one of the
+ * up phases of the filter. When up is more than MAX_PHASES only MAX_PHASES
+ * are kept and the phase is truncated to the row below, not interpolated:
+ * an output sample is then taken up to 1 / MAX_PHASES of an input sample
+ * early, a jitter noise about 56 dB under a full scale tone at a quarter of
+ * the input rate, below the 8 bit output anyway. The dot product uses SSE or
+ * NEON when the compiler targets them.
+ * The cutoff is below the lower Nyquist frequency of the two rates, so a
+ * downsampled signal does not alias.
+*/
+class PolyphaseResampler
+{
+public:
+  PolyphaseResampler();
+
+  void configure(int inputRate, int outputRate);
+
+  // appends to output the samples the input completes
+  void process(const float* input, int count, QVector<float>& output);
+
+  // the input ended: appends what is still waiting in the filter
+  void flush(QVector<float>& output);
+
+  int inputRate() const;
+
+  int outputRate() const;
+
+private:
+  // zero crossings of the sinc on each side, at the lower of the two rates
+  static const int ZERO_CROSSINGS = 16;
+  static const int MAX_PHASES = 1024;
+  // of the lower Nyquist frequency, the rest is the transition band
+  static const float CUTOFF;
+  static const float KAISER_BETA;
+
+  int m_inputRate;
+  int m_outputRate;
+  int m_up;
+  int m_down;
+  int m_phases;
+  int m_taps; // per phase, a multiple of 8
+  QVector<float> m_filter; // m_phases rows of m_taps coefficients
+  QVector<float> m_history; // input not consumed yet, m_taps / 2 - 1 zeros first
+  qint64 m_position; // of the next output, in 1 / m_up input samples from m_history[0]
+  qint64 m_inputCount;
+  qint64 m_outputCount;
+
+  void run(QVector<float>& output, qint64 outputLimit);
+
+  static float dot(const float* a, const float* b, int count);
+
+  static double besselI0(double x);
+};
+
+#endif // RESAMPLER_H
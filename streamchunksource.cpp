@@ -0,0 +1,143 @@
+#include "streamchunksource.h"
+#include <QMutexLocker>
+#include <string.h>
+
+StreamChunkSource::StreamChunkSource(int capacity, QObject *parent) :
+  QObject(parent)
+{
+  // whole chunks, so a chunk wraps around at most once
+  m_capacity = qMax(capacity / FILECHUNK_SIZE, 1) * FILECHUNK_SIZE;
+  m_ring = new char[m_capacity];
+  m_start = 0;
+  m_end = 0;
+  m_finished = false;
+  m_aborted = false;
+  m_hash = CONTENT_HASH_INIT;
+}
+
+StreamChunkSource::~StreamChunkSource()
+{
+  delete[] m_ring;
+}
+
+qint64 StreamChunkSource::write(const char* data, qint64 length)
+{
+  QMutexLocker locker(&m_mutex);
+
+  if(m_finished || m_aborted)
+    return 0;
+
+  qint64 taken = qMin(length, m_capacity - (m_end - m_start));
+  qint64 offset = m_end % m_capacity;
+  qint64 first = qMin(taken, m_capacity - offset);
+
+  memcpy(m_ring + offset, data, first);
+  memcpy(m_ring, data + first, taken - first);
+  m_end += taken;
+  m_hash = contentHashUpdate(m_hash, (const uint8_t*) data, taken);
+  locker.unlock();
+
+  if(taken > 0)
+    emit dataAvailable();
+  return taken;
+}
+
+qint64 StreamChunkSource::freeSpace() const
+{
+  QMutexLocker locker(&m_mutex);
+  return m_capacity - (m_end - m_start);
+}
+
+void StreamChunkSource::finish()
+{
+  m_mutex.lock();
+  m_finished = true;
+  m_mutex.unlock();
+  emit dataAvailable();
+}
+
+void StreamChunkSource::abort()
+{
+  m_mutex.lock();
+  m_aborted = true;
+  m_mutex.unlock();
+  emit dataAvailable();
+}
+
+bool StreamChunkSource::chunk(uint32_t index, uint8_t* data, uint16_t* length) const
+{
+  QMutexLocker locker(&m_mutex);
+  qint64 chunkStart = (qint64) index * FILECHUNK_SIZE;
+
+  if(index >= readyChunks() || chunkStart < m_start)
+    return false;
+
+  qint64 chunkLength = qMin((qint64) FILECHUNK_SIZE, m_end - chunkStart);
+  qint64 offset = chunkStart % m_capacity;
+  qint64 first = qMin(chunkLength, m_capacity - offset);
+
+  memcpy(data, m_ring + offset, first);
+  memcpy(data + first, m_ring, chunkLength - first);
+  *length = chunkLength;
+  return true;
+}
+
+bool StreamChunkSource::isChunkReady(uint32_t index) const
+{
+  QMutexLocker locker(&m_mutex);
+  return index < readyChunks();
+}
+
+void StreamChunkSource::release(uint32_t index)
+{
+  QMutexLocker locker(&m_mutex);
+  qint64 start = qMin((qint64) index * FILECHUNK_SIZE, m_end);
+
+  if(start <= m_start)
+    return;
+
+  m_start = start;
+  locker.unlock();
+  emit spaceFreed();
+}
+
+bool StreamChunkSource::isFinished() const
+{
+  QMutexLocker locker(&m_mutex);
+  return m_finished;
+}
+
+bool StreamChunkSource::isAborted() const
+{
+  QMutexLocker locker(&m_mutex);
+  return m_aborted;
+}
+
+qint64 StreamChunkSource::length() const
+{
+  QMutexLocker locker(&m_mutex);
+  return m_end;
+}
+
+uint32_t StreamChunkSource::chunksCount() const
+{
+  QMutexLocker locker(&m_mutex);
+  return readyChunks();
+}
+
+uint64_t StreamChunkSource::contentHash() const
+{
+  QMutexLocker locker(&m_mutex);
+  return m_hash;
+}
+
+/*
+ * a partial chunk only counts once nothing else can be added to it
+*/
+uint32_t StreamChunkSource::readyChunks() const
+{
+  if(m_finished)
+    return (m_end + FILECHUNK_SIZE - 1) / FILECHUNK_SIZE;
+
+  return m_end / FILECHUNK_SIZE;
+}
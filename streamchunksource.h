@@ -0,0 +1,82 @@
+#ifndef STREAMCHUNKSOURCE_H
+#define STREAMCHUNKSOURCE_H
+
+#include <QObject>
+#include <QMutex>
+#include "protocol.h"
+
+/*
+ * Chunks of a file that is still being produced, eg. by ffmpeg, for a streaming
+ * upload (see Streaming uploads in protocol.h).
+ * The producer writes from any thread into a ring of fixed capacity, and the
+ * client reads the chunks from its own thread and releases them once answered,
+ * so memory does not grow with the length of the file: a full ring means the
+ * producer has to wait for spaceFreed().
+ * The capacity must fit the upload window, otherwise the window is not filled.
+*/
+class StreamChunkSource : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit StreamChunkSource(int capacity, QObject *parent = 0);
+  ~StreamChunkSource();
+
+  // producer side
+
+  // returns how much was taken, less than length when the ring is full
+  qint64 write(const char* data, qint64 length);
+
+  qint64 freeSpace() const;
+
+  // no more data: the last chunk may be shorter
+  void finish();
+
+  // the data will never be complete, the upload must fail
+  void abort();
+
+  // client side
+
+  // copies the chunk into data, which holds FILECHUNK_SIZE bytes.
+  // false if it is not complete yet or was already released
+  bool chunk(uint32_t index, uint8_t* data, uint16_t* length) const;
+
+  bool isChunkReady(uint32_t index) const;
+
+  // chunks before index are no longer needed
+  void release(uint32_t index);
+
+  bool isFinished() const;
+
+  bool isAborted() const;
+
+  // bytes written so far, the file length once finished
+  qint64 length() const;
+
+  // complete chunks so far, all of them once finished
+  uint32_t chunksCount() const;
+
+  // contentHashUpdate of the data written so far, of the whole file once finished
+  uint64_t contentHash() const;
+
+signals:
+  // written, finished or aborted
+  void dataAvailable();
+
+  void spaceFreed();
+
+private:
+  mutable QMutex m_mutex;
+  char* m_ring;
+  qint64 m_capacity;
+  qint64 m_start; // stream offset of the first byte still in the ring
+  qint64 m_end;   // stream offset after the last byte written
+  bool m_finished;
+  bool m_aborted;
+  uint64_t m_hash; // computed as it is written, the data does not stay
+
+  uint32_t readyChunks() const;
+
+};
+
+#endif // STREAMCHUNKSOURCE_H
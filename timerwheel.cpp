@@ -0,0 +1,113 @@
+#include "timerwheel.h"
+
+TimerWheel::Timer::Timer()
+{
+  prev = NULL;
+  next = NULL;
+  expiry = 0;
+  tag = 0;
+  id = 0;
+}
+
+bool TimerWheel::Timer::isArmed() const
+{
+  return prev != NULL;
+}
+
+TimerWheel::TimerWheel(int tickMs)
+{
+  // empty lists point to themselves
+  for(int i = 0; i < SLOTS; i++)
+    m_slots[i].prev = m_slots[i].next = &m_slots[i];
+  m_expired.prev = m_expired.next = &m_expired;
+
+  m_tickMs = tickMs > 0 ? tickMs : 1;
+  m_nextTick = 0;
+  m_armed = 0;
+}
+
+int TimerWheel::tickMs() const
+{
+  return m_tickMs;
+}
+
+void TimerWheel::arm(Timer *timer, qint64 now, qint64 delayMs)
+{
+  cancel(timer);
+
+  // rounded up, never before a tick that is still to be processed
+  qint64 expiry = (now + qMax(delayMs, (qint64) 0) + m_tickMs - 1) / m_tickMs;
+  if(expiry < m_nextTick)
+    expiry = m_nextTick;
+
+  timer->expiry = expiry;
+  append(&m_slots[expiry % SLOTS], timer);
+  m_armed++;
+}
+
+void TimerWheel::cancel(Timer *timer)
+{
+  if(!timer->isArmed())
+    return;
+
+  unlink(timer);
+  m_armed--;
+}
+
+TimerWheel::Timer* TimerWheel::expire(qint64 now)
+{
+  qint64 tick = now / m_tickMs;
+
+  if(tick >= m_nextTick)
+  {
+    // a late tick covers every slot once at most
+    qint64 ticks = qMin(tick - m_nextTick + 1, (qint64) SLOTS);
+
+    for(qint64 i = 0; i < ticks; i++)
+    {
+      Timer* head = &m_slots[(m_nextTick + i) % SLOTS];
+      Timer* timer = head->next;
+
+      while(timer != head)
+      {
+        Timer* next = timer->next;
+        if(timer->expiry <= tick)
+        {
+          unlink(timer);
+          append(&m_expired, timer);
+        }
+        timer = next;
+      }
+    }
+    m_nextTick = tick + 1;
+  }
+
+  if(m_expired.next == &m_expired)
+    return NULL;
+
+  Timer* timer = m_expired.next;
+  unlink(timer);
+  m_armed--;
+  return timer;
+}
+
+bool TimerWheel::isEmpty() const
+{
+  return m_armed == 0;
+}
+
+void TimerWheel::unlink(Timer *timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = NULL;
+  timer->next = NULL;
+}
+
+void TimerWheel::append(Timer *head, Timer *timer)
+{
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
@@ -0,0 +1,60 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QtGlobal>
+
+/*
+ * Hashed timer wheel: every protocol deadline (requests, idle probes, pacing)
+ * is a Timer node owned by whoever uses it, linked in the slot of the tick it
+ * expires at. Arming and cancelling are O(1) and the owner drives the wheel from
+ * a single periodic tick with expire(), so the cost does not grow with the
+ * number of requests in flight.
+ * Timers further away than a full turn stay in their slot until their turn comes.
+*/
+class TimerWheel
+{
+public:
+  struct Timer
+  {
+    Timer* prev;
+    Timer* next;
+    qint64 expiry; // tick
+    int tag;       // what the owner does when it expires
+    int id;        // which one, e.g. a msg id
+
+    Timer();
+
+    bool isArmed() const;
+  };
+
+  explicit TimerWheel(int tickMs);
+
+  int tickMs() const;
+
+  // (re)arms the timer to expire delayMs after now. times in ms, from one monotonic clock
+  void arm(Timer* timer, qint64 now, qint64 delayMs);
+
+  void cancel(Timer* timer);
+
+  // returns one timer expired at now, disarmed, or NULL when there are no more.
+  // timers may be armed and cancelled between calls
+  Timer* expire(qint64 now);
+
+  bool isEmpty() const;
+
+private:
+  static const int SLOTS = 256;
+
+  Timer m_slots[SLOTS]; // list heads
+  Timer m_expired;      // expired and not returned yet
+  int m_tickMs;
+  qint64 m_nextTick;    // first tick not processed yet
+  int m_armed;
+
+  static void unlink(Timer* timer);
+
+  static void append(Timer* head, Timer* timer);
+
+};
+
+#endif // TIMERWHEEL_H
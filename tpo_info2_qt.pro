@@ -8,12 +8,31 @@ SOURCES += \
     main.cpp \
     mainwindow.cpp \
     client.cpp \
+    chunksource.cpp \
+    streamchunksource.cpp \
+    audioconverter.cpp \
+    uploadqueue.cpp \
+    conversioncache.cpp \
+    wavdecoder.cpp \
+    resampler.cpp \
+    msgidallocator.cpp \
+    timerwheel.cpp \
     protocol.c
 
 HEADERS += \
     mainwindow.h \
     protocol.h \
-    client.h
+    crctables.h \
+    client.h \
+    chunksource.h \
+    streamchunksource.h \
+    audioconverter.h \
+    uploadqueue.h \
+    conversioncache.h \
+    wavdecoder.h \
+    resampler.h \
+    msgidallocator.h \
+    timerwheel.h
 
 FORMS += \
     mainwindow.ui
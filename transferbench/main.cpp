@@ -0,0 +1,99 @@
+#include <QCoreApplication>
+#include <QStringList>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "transferbench.h"
+
+static void usage(const char* program)
+{
+  printf("usage: %s [options]\n"
+         "  --baud list     baud rates, comma separated (default 9600,19200,38400,57600,115200)\n"
+         "  --window list   chunks in flight (default 1,4,16,64)\n"
+         "  --ber list      bit error rates (default 0,1e-6,1e-5,1e-4)\n"
+         "  --size bytes    file uploaded in every case (default 16384)\n"
+         "  --latency ms    device response latency (default 2)\n"
+         "  --drop rate     share of requests the device ignores (default 0)\n"
+         "  --seed n        seed of the file, bit errors and drops (default 1)\n"
+         "  --timeout s     give up on a case after this long (default 120)\n"
+         "  --json          one JSON object per line instead of CSV\n"
+         "  --verbose       client log to stderr\n", program);
+}
+
+static bool parseList(const char* text, QList<double>& values)
+{
+  values.clear();
+  foreach(QString item, QString(text).split(',', QString::SkipEmptyParts))
+  {
+    bool ok;
+    values.append(item.toDouble(&ok));
+    if(!ok)
+      return false;
+  }
+  return !values.isEmpty();
+}
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  TransferOptions options;
+  QList<double> values;
+
+  options.baudRates << 9600 << 19200 << 38400 << 57600 << 115200; // MainWindow::loadBaudRateList
+  options.windows << 1 << 4 << 16 << 64;
+  options.bitErrorRates << 0 << 1e-6 << 1e-5 << 1e-4;
+  options.fileSize = 16384;
+  options.latency = 2;
+  options.dropRate = 0;
+  options.seed = 1;
+  options.timeoutSeconds = 120;
+  options.json = false;
+  options.verbose = false;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--baud") && i + 1 < argc && parseList(argv[++i], values))
+    {
+      options.baudRates.clear();
+      foreach(double value, values)
+        options.baudRates.append((qint32) value);
+    }
+    else if(!strcmp(argv[i], "--window") && i + 1 < argc && parseList(argv[++i], values))
+    {
+      options.windows.clear();
+      foreach(double value, values)
+        options.windows.append((int) value);
+    }
+    else if(!strcmp(argv[i], "--ber") && i + 1 < argc && parseList(argv[++i], values))
+      options.bitErrorRates = values;
+    else if(!strcmp(argv[i], "--size") && i + 1 < argc)
+      options.fileSize = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--latency") && i + 1 < argc)
+      options.latency = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--drop") && i + 1 < argc)
+      options.dropRate = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--seed") && i + 1 < argc)
+      options.seed = strtoull(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "--timeout") && i + 1 < argc)
+      options.timeoutSeconds = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--json"))
+      options.json = true;
+    else if(!strcmp(argv[i], "--verbose"))
+      options.verbose = true;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(options.fileSize <= 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  TransferBench bench(options);
+  bench.run();
+  return 0;
+}
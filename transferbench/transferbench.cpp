@@ -0,0 +1,219 @@
+#include "transferbench.h"
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QTemporaryFile>
+#include <QTimer>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include "deviceemulator.h"
+
+TransferBench::TransferBench(const TransferOptions& options, QObject *parent) :
+  QObject(parent)
+{
+  m_options = options;
+  m_deviceConnected = false;
+  m_retransmits = 0;
+}
+
+void TransferBench::run()
+{
+  printHeader();
+
+  foreach(qint32 baudRate, m_options.baudRates)
+    foreach(int window, m_options.windows)
+      foreach(double bitErrorRate, m_options.bitErrorRates)
+        print(runCase(baudRate, window, bitErrorRate));
+}
+
+TransferResult TransferBench::runCase(qint32 baudRate, int window, double bitErrorRate)
+{
+  TransferResult result;
+  result.baudRate = baudRate;
+  result.window = window;
+  result.bitErrorRate = bitErrorRate;
+  result.seconds = 0;
+  result.chunks = (m_options.fileSize + FILECHUNK_SIZE - 1) / FILECHUNK_SIZE;
+  result.retransmits = 0;
+  result.roundTripP50 = 0;
+  result.roundTripP99 = 0;
+  result.bitErrors = 0;
+  result.deviceResyncs = 0;
+
+  // the same file every case, so results only differ by the link
+  QTemporaryFile file;
+  QByteArray content(m_options.fileSize, 0);
+  LinkRandom random(m_options.seed);
+  for(int i = 0; i < content.size(); i++)
+    content[i] = (char) random.next();
+  if(!file.open() || file.write(content) != content.size() || !file.flush())
+  {
+    result.result = "no_file";
+    return result;
+  }
+
+  // device end: runs on its own thread until the case ends
+  SdImage sd;
+  PtyLink link;
+  if(!sd.open(NULL, SdImage::DIRECTORY_BLOCKS + SdImage::blocksFor(m_options.fileSize) + 1, true)
+     || !link.open(NULL))
+  {
+    result.result = "no_pty";
+    return result;
+  }
+  link.configure(baudRate, bitErrorRate, m_options.seed);
+  DeviceEmulator device(&link, &sd);
+  device.setResponseLatency(m_options.latency);
+  device.setDropRate(m_options.dropRate, m_options.seed);
+  std::atomic<bool> running(true);
+  std::thread emulator([&device, &running]() { device.run(running); });
+
+  Client client;
+  QEventLoop loop;
+  QTimer timeout;
+  timeout.setSingleShot(true);
+  connect(&timeout, SIGNAL(timeout()), &loop, SLOT(quit()));
+  connect(&client, SIGNAL(deviceStatusChanged(bool)), this, SLOT(handleDeviceStatusChanged(bool)));
+  connect(&client, SIGNAL(deviceStatusChanged(bool)), &loop, SLOT(quit()));
+  connect(&client, SIGNAL(chunkRoundTrip(qint64)), this, SLOT(handleChunkRoundTrip(qint64)));
+  connect(&client, SIGNAL(chunkRetransmitted(uint32_t,int)), this, SLOT(handleChunkRetransmitted(uint32_t,int)));
+  connect(&client, SIGNAL(log(QString)), this, SLOT(handleLog(QString)));
+  m_deviceConnected = false;
+  m_roundTrips.clear();
+  m_roundTrips.reserve(result.chunks * 2);
+  m_retransmits = 0;
+
+  if(client.openSerialPort(link.slaveName(), baudRate))
+  {
+    client.setFileSendWindow(window);
+    client.sendHandshakeRequest();
+    timeout.start(HANDSHAKE_TIMEOUT_MS);
+    while(!m_deviceConnected && timeout.isActive())
+      loop.exec();
+  }
+
+  if(!m_deviceConnected)
+  {
+    result.result = "no_device";
+  }
+  else
+  {
+    QFutureWatcher<RequestReply> watcher;
+    QElapsedTimer clock;
+    connect(&watcher, SIGNAL(finished()), &loop, SLOT(quit()));
+
+    clock.start();
+    watcher.setFuture(client.sendFileAsync(&file, 8000, "BENCH"));
+    timeout.start(m_options.timeoutSeconds * 1000);
+    while(!watcher.isFinished() && timeout.isActive())
+      loop.exec();
+    result.seconds = clock.nsecsElapsed() / 1e9;
+
+    if(!watcher.isFinished())
+      result.result = "timeout";
+    else
+    {
+      switch(watcher.result().error){
+        case REQUEST_OK:
+          result.result = "ok";
+          break;
+        case REQUEST_TIMEOUT:
+          result.result = "chunk_timeout";
+          break;
+        case REQUEST_REJECTED:
+          result.result = "rejected";
+          break;
+        case REQUEST_QUEUE_FULL:
+          result.result = "queue_full";
+          break;
+        case REQUEST_DISCONNECTED:
+          result.result = "disconnected";
+          break;
+      }
+    }
+  }
+
+  client.closeSerialPort();
+  running = false;
+  emulator.join();
+
+  result.retransmits = m_retransmits;
+  result.roundTripP50 = percentile(m_roundTrips, 0.50) / 1000.0;
+  result.roundTripP99 = percentile(m_roundTrips, 0.99) / 1000.0;
+  result.bitErrors = link.bitErrors();
+  result.deviceResyncs = device.stats().resyncs;
+
+  return result;
+}
+
+void TransferBench::printHeader()
+{
+  if(!m_options.json)
+    printf("baud,chunk_size,window,ber,latency_ms,bytes,seconds,payload_bytes_per_s,line_efficiency,"
+           "chunks,retransmits,rtt_p50_ms,rtt_p99_ms,bit_errors,device_resyncs,result\n");
+}
+
+/*
+ * line efficiency is the payload throughput over what the line carries:
+ * baud / 10 bytes per second
+*/
+void TransferBench::print(const TransferResult& result)
+{
+  double throughput = result.result == "ok" ? m_options.fileSize / result.seconds : 0;
+  double efficiency = throughput / (result.baudRate / 10.0);
+
+  if(m_options.json)
+    printf("{\"baud\":%d,\"chunk_size\":%d,\"window\":%d,\"ber\":%g,\"latency_ms\":%d,\"bytes\":%d,"
+           "\"seconds\":%.3f,\"payload_bytes_per_s\":%.1f,\"line_efficiency\":%.4f,\"chunks\":%u,"
+           "\"retransmits\":%u,\"rtt_p50_ms\":%.3f,\"rtt_p99_ms\":%.3f,\"bit_errors\":%llu,"
+           "\"device_resyncs\":%llu,\"result\":\"%s\"}\n",
+           result.baudRate, FILECHUNK_SIZE, result.window, result.bitErrorRate, m_options.latency,
+           m_options.fileSize, result.seconds, throughput, efficiency, result.chunks,
+           result.retransmits, result.roundTripP50, result.roundTripP99,
+           (unsigned long long) result.bitErrors, (unsigned long long) result.deviceResyncs,
+           result.result.toLatin1().constData());
+  else
+    printf("%d,%d,%d,%g,%d,%d,%.3f,%.1f,%.4f,%u,%u,%.3f,%.3f,%llu,%llu,%s\n",
+           result.baudRate, FILECHUNK_SIZE, result.window, result.bitErrorRate, m_options.latency,
+           m_options.fileSize, result.seconds, throughput, efficiency, result.chunks,
+           result.retransmits, result.roundTripP50, result.roundTripP99,
+           (unsigned long long) result.bitErrors, (unsigned long long) result.deviceResyncs,
+           result.result.toLatin1().constData());
+
+  fflush(stdout);
+}
+
+double TransferBench::percentile(QVector<qint64>& values, double fraction)
+{
+  if(values.isEmpty())
+    return 0;
+
+  int index = (int) (fraction * (values.size() - 1) + 0.5);
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+void TransferBench::handleDeviceStatusChanged(bool connected)
+{
+  m_deviceConnected = connected;
+}
+
+void TransferBench::handleChunkRoundTrip(qint64 microseconds)
+{
+  m_roundTrips.append(microseconds);
+}
+
+void TransferBench::handleChunkRetransmitted(uint32_t chunkId, int retries)
+{
+  Q_UNUSED(chunkId);
+  Q_UNUSED(retries);
+  m_retransmits++;
+}
+
+void TransferBench::handleLog(QString message)
+{
+  if(m_options.verbose)
+    fprintf(stderr, "%s\n", message.toLocal8Bit().constData());
+}
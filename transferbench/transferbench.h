@@ -0,0 +1,80 @@
+#ifndef TRANSFERBENCH_H
+#define TRANSFERBENCH_H
+
+#include <QObject>
+#include <QList>
+#include <QVector>
+#include <QString>
+#include "client.h"
+
+struct TransferOptions
+{
+  QList<qint32> baudRates;
+  QList<int> windows;
+  QList<double> bitErrorRates;
+  int fileSize;       // bytes uploaded in every case
+  int latency;        // ms the device takes to answer
+  double dropRate;    // requests the device ignores
+  quint64 seed;       // of the file contents, bit errors and drops
+  int timeoutSeconds; // a case that takes longer is reported as a timeout
+  bool json;          // JSON lines instead of CSV
+  bool verbose;       // client log to stderr
+};
+
+struct TransferResult
+{
+  qint32 baudRate;
+  int window;
+  double bitErrorRate;
+  QString result;
+  double seconds;
+  quint32 chunks;
+  quint32 retransmits;
+  double roundTripP50; // ms
+  double roundTripP99; // ms
+  quint64 bitErrors;
+  quint64 deviceResyncs;
+};
+
+/*
+ * Uploads a file with the real Client over a pty to an in-process DeviceEmulator,
+ * once per baud rate x window x bit error rate, and prints a line per case.
+ * The chunk size is FILECHUNK_SIZE, fixed at build time (see transferbench.pro).
+*/
+class TransferBench : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit TransferBench(const TransferOptions& options, QObject *parent = 0);
+
+  void run();
+
+private:
+  const int HANDSHAKE_TIMEOUT_MS = 3000;
+
+  TransferOptions m_options;
+  bool m_deviceConnected;
+  QVector<qint64> m_roundTrips; // us
+  quint32 m_retransmits;
+
+  TransferResult runCase(qint32 baudRate, int window, double bitErrorRate);
+
+  void printHeader();
+
+  void print(const TransferResult& result);
+
+  static double percentile(QVector<qint64>& values, double fraction);
+
+private slots:
+  void handleDeviceStatusChanged(bool connected);
+
+  void handleChunkRoundTrip(qint64 microseconds);
+
+  void handleChunkRetransmitted(uint32_t chunkId, int retries);
+
+  void handleLog(QString message);
+
+};
+
+#endif // TRANSFERBENCH_H
@@ -0,0 +1,41 @@
+# End to end upload benchmark: the real Client against the device emulator over a pty
+# (Linux only). Build it on its own: qmake transferbench/transferbench.pro && make
+# Run ./tpo_info2_transferbench --help for options. Results go to stdout as CSV (or JSON lines).
+#
+# FILECHUNK_SIZE is part of the wire format, so it is swept by building once per size:
+#   qmake "DEFINES+=FILECHUNK_SIZE=256" transferbench/transferbench.pro && make
+# the chunk_size column tells the builds apart.
+
+QT += core serialport
+QT -= gui
+TARGET = tpo_info2_transferbench
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+INCLUDEPATH += .. ../emulator
+
+SOURCES += \
+    main.cpp \
+    transferbench.cpp \
+    ../client.cpp \
+    ../chunksource.cpp \
+    ../streamchunksource.cpp \
+    ../msgidallocator.cpp \
+    ../timerwheel.cpp \
+    ../protocol.c \
+    ../emulator/ptylink.cpp \
+    ../emulator/sdimage.cpp \
+    ../emulator/deviceemulator.cpp
+
+HEADERS += \
+    transferbench.h \
+    ../client.h \
+    ../chunksource.h \
+    ../streamchunksource.h \
+    ../msgidallocator.h \
+    ../timerwheel.h \
+    ../protocol.h \
+    ../emulator/ptylink.h \
+    ../emulator/sdimage.h \
+    ../emulator/deviceemulator.h
@@ -0,0 +1,253 @@
+#include "uploadqueue.h"
+#include "audioconverter.h"
+#include <QFileInfo>
+#include <QDir>
+#include <QTemporaryFile>
+
+UploadQueue::UploadQueue(Client* client, QString cacheDirectory, qint64 cacheSize, QObject *parent) :
+  QObject(parent),
+  m_cache(cacheDirectory, cacheSize)
+{
+  m_client = client;
+  m_nextUpload = 0;
+  m_done = 0;
+  m_failed = 0;
+  m_abort.store(0);
+}
+
+UploadQueue::~UploadQueue()
+{
+  // the tasks use m_cache. those not started are dropped, the others
+  // stop at their next block, so closing does not wait for the whole batch
+  m_abort.store(1);
+  m_pool.clear();
+  m_pool.waitForDone();
+}
+
+void UploadQueue::add(QStringList sources, int sampleRate)
+{
+  foreach(const QString& source, sources)
+  {
+    Item item;
+    item.source = source;
+    item.name = QFileInfo(source).fileName().toUpper();
+    item.sampleRate = sampleRate;
+    item.file = NULL;
+    item.contentHash = 0;
+    item.upload = NULL;
+    item.state = ITEM_CONVERTING;
+    m_items.append(item);
+
+    // deleted here once it is done, not by the pool
+    ConversionTask* task = new ConversionTask(m_items.size() - 1, source, sampleRate, &m_cache, &m_abort);
+    task->setParent(this);
+    task->setAutoDelete(false);
+    connect(task, SIGNAL(finished(int, QString, QString, quint64)),
+            this, SLOT(handleConversionFinished(int, QString, QString, quint64)));
+    connect(task, SIGNAL(log(QString)), this, SIGNAL(log(QString)));
+    m_pool.start(task);
+  }
+
+  startUploads();
+}
+
+bool UploadQueue::isBusy() const
+{
+  return m_done < m_items.size();
+}
+
+int UploadQueue::count() const
+{
+  return m_items.size();
+}
+
+int UploadQueue::done() const
+{
+  return m_done;
+}
+
+void UploadQueue::handleConversionFinished(int index, QString path, QString cacheKey, quint64 contentHash)
+{
+  Item& item = m_items[index];
+
+  sender()->deleteLater();
+
+  if(path.isEmpty())
+  {
+    itemFinished(index, false);
+    startUploads();
+    return;
+  }
+
+  item.cacheKey = cacheKey;
+  item.contentHash = contentHash;
+  item.file = new QFile(path, this);
+  if(item.file->open(QIODevice::ReadOnly))
+    item.state = ITEM_CONVERTED;
+  else
+  {
+    emit log(QString("%1: could not open the converted audio: %2").arg(item.name).arg(item.file->errorString()));
+    itemFinished(index, false);
+  }
+
+  startUploads();
+}
+
+/*
+ * hands the converted files to the client in order, up to the first one
+ * still converting
+*/
+void UploadQueue::startUploads()
+{
+  while(m_nextUpload < m_items.size() && m_items[m_nextUpload].state != ITEM_CONVERTING)
+  {
+    Item& item = m_items[m_nextUpload];
+
+    if(item.state == ITEM_CONVERTED)
+    {
+      item.state = ITEM_UPLOADING;
+      item.upload = new QFutureWatcher<RequestReply>(this);
+      connect(item.upload, SIGNAL(finished()), this, SLOT(handleUploadFinished()));
+      item.upload->setFuture(m_client->sendFileAsync(item.file, item.sampleRate, item.name, item.contentHash));
+    }
+    m_nextUpload++;
+  }
+}
+
+void UploadQueue::handleUploadFinished()
+{
+  for(int i = 0; i < m_items.size(); i++)
+  {
+    if(m_items[i].upload != sender())
+      continue;
+
+    RequestReply reply = m_items[i].upload->result();
+    if(reply.error == REQUEST_REJECTED)
+      emit log(QString("%1: the device rejected the upload.").arg(m_items[i].name));
+    else if(reply.error == REQUEST_TIMEOUT)
+      emit log(QString("%1: the device stopped answering.").arg(m_items[i].name));
+    else if(reply.error != REQUEST_OK)
+      emit log(QString("%1: the upload was cancelled.").arg(m_items[i].name));
+
+    m_items[i].upload->deleteLater();
+    m_items[i].upload = NULL;
+    itemFinished(i, reply.error == REQUEST_OK);
+    return;
+  }
+}
+
+void UploadQueue::itemFinished(int index, bool success)
+{
+  Item& item = m_items[index];
+
+  item.state = success ? ITEM_UPLOADED : ITEM_FAILED;
+  if(item.file != NULL)
+  {
+    if(item.cacheKey.isEmpty())
+      item.file->remove();
+    else
+      m_cache.release(item.cacheKey);
+    delete item.file;
+    item.file = NULL;
+  }
+
+  m_done++;
+  if(!success)
+    m_failed++;
+  emit fileFinished(index, m_items.size(), item.name, success);
+
+  if(m_done == m_items.size())
+  {
+    int uploaded = m_done - m_failed;
+    int failed = m_failed;
+
+    m_items.clear();
+    m_nextUpload = 0;
+    m_done = 0;
+    m_failed = 0;
+    emit finished(uploaded, failed);
+  }
+}
+
+ConversionTask::ConversionTask(int index, QString source, int sampleRate, ConversionCache* cache, const QAtomicInt* abort)
+{
+  m_index = index;
+  m_source = source;
+  m_sampleRate = sampleRate;
+  m_cache = cache;
+  m_abort = abort;
+}
+
+void ConversionTask::run()
+{
+  QString cacheKey;
+  quint64 contentHash = 0;
+  QString path = convert(&cacheKey, &contentHash);
+
+  // this may be deleted as soon as it is emitted
+  emit finished(m_index, path, cacheKey, contentHash);
+}
+
+/*
+ * the converter is made here, so it and its QAudioDecoder belong to the pool
+ * thread and run in the event loop of AudioConverter::convert()
+*/
+QString ConversionTask::convert(QString* cacheKey, quint64* contentHash)
+{
+  QString key = ConversionCache::key(m_source, m_sampleRate);
+  QString path;
+
+  if(key.isEmpty())
+  {
+    forwardLog(QString("Could not read the audio file."));
+    return QString();
+  }
+
+  // hashing a long file takes a while too
+  if(m_abort->load() != 0)
+    return QString();
+
+  path = m_cache->acquire(key, contentHash);
+  if(!path.isEmpty())
+  {
+    forwardLog(QString("Converted before, taken from the cache."));
+    *cacheKey = key;
+    return path;
+  }
+
+  // in the cache directory, so it only has to be renamed into it
+  QString directory = m_cache->isValid() ? m_cache->directory() : QDir::tempPath();
+  QTemporaryFile output(directory + "/XXXXXX.part");
+  AudioConverter converter;
+
+  if(!output.open())
+  {
+    forwardLog(QString("Could not create a temporary file."));
+    return QString();
+  }
+
+  connect(&converter, SIGNAL(log(QString)), this, SLOT(forwardLog(QString)), Qt::DirectConnection);
+  bool success = converter.convert(m_source, m_sampleRate, &output, m_abort);
+  disconnect(&converter, 0, this, 0);
+  if(!success)
+    return QString();
+
+  *contentHash = converter.contentHash();
+  output.close();
+  path = m_cache->insert(key, output.fileName(), *contentHash);
+  if(!path.isEmpty())
+  {
+    *cacheKey = key;
+    return path;
+  }
+
+  // not cached, the queue removes it after the upload
+  forwardLog(QString("Could not add the converted audio to the cache."));
+  output.setAutoRemove(false);
+  return output.fileName();
+}
+
+void ConversionTask::forwardLog(QString message)
+{
+  emit log(QString("%1: %2").arg(QFileInfo(m_source).fileName().toUpper()).arg(message));
+}
@@ -0,0 +1,129 @@
+#ifndef UPLOADQUEUE_H
+#define UPLOADQUEUE_H
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QStringList>
+#include <QList>
+#include <QAtomicInt>
+#include "client.h"
+#include "conversioncache.h"
+
+/*
+ * Uploads several audio files one after another.
+ * They are all converted at once on a QThreadPool, into a ConversionCache
+ * (files converted before are taken from it as they are), and handed to the client in the order they were added as soon as
+ * they are ready. The client queues the uploads, so the header of the next
+ * file goes out as soon as the previous one is stored and the link is never
+ * idle while conversions run ahead. A file that can not be converted or
+ * uploaded is reported and skipped, the others go on.
+ * Files added while a batch is running join it.
+*/
+class UploadQueue : public QObject
+{
+  Q_OBJECT
+
+public:
+  // conversions are kept in cacheDirectory, up to cacheSize bytes
+  UploadQueue(Client* client, QString cacheDirectory, qint64 cacheSize, QObject *parent = 0);
+  ~UploadQueue();
+
+  void add(QStringList sources, int sampleRate);
+
+  // true until every file added is uploaded or failed
+  bool isBusy() const;
+
+  int count() const;
+
+  // uploaded or failed so far
+  int done() const;
+
+private:
+  enum ItemState
+  {
+    ITEM_CONVERTING,
+    ITEM_CONVERTED,
+    ITEM_UPLOADING, // handed to the client, maybe still waiting in its queue
+    ITEM_UPLOADED,
+    ITEM_FAILED,
+  };
+
+  struct Item
+  {
+    QString source;
+    QString name; // as stored in the device
+    int sampleRate;
+    QFile* file; // the converted audio, NULL while converting
+    QString cacheKey; // empty if it is not in the cache
+    quint64 contentHash; // of the converted audio, 0 if not known
+    QFutureWatcher<RequestReply>* upload;
+    ItemState state;
+  };
+
+  Client* m_client;
+  ConversionCache m_cache;
+  QThreadPool m_pool; // after m_cache, so it is destroyed, and waits for its tasks, first
+  QAtomicInt m_abort; // set when destroyed, the running tasks stop
+  QList<Item> m_items;
+  int m_nextUpload; // the first item not handed to the client yet
+  int m_done;
+  int m_failed;
+
+  void startUploads();
+
+  void itemFinished(int index, bool success);
+
+private slots:
+  void handleConversionFinished(int index, QString path, QString cacheKey, quint64 contentHash);
+
+  void handleUploadFinished();
+
+signals:
+  // index among count() files, in the order they were added
+  void fileFinished(int index, int count, QString name, bool success);
+
+  void finished(int uploaded, int failed);
+
+  void log(QString message);
+
+};
+
+/*
+ * Converts one file of an UploadQueue on a thread of its pool, unless it is
+ * in the cache already.
+*/
+class ConversionTask : public QObject, public QRunnable
+{
+  Q_OBJECT
+
+public:
+  // abort is checked between blocks, it gives up when set
+  ConversionTask(int index, QString source, int sampleRate, ConversionCache* cache, const QAtomicInt* abort);
+
+  void run();
+
+private:
+  int m_index;
+  QString m_source;
+  int m_sampleRate;
+  ConversionCache* m_cache;
+  const QAtomicInt* m_abort;
+
+  QString convert(QString* cacheKey, quint64* contentHash);
+
+private slots:
+  void forwardLog(QString message);
+
+signals:
+  // emitted on the pool thread. path is empty if it failed, and cacheKey
+  // when it is a temporary file left out of the cache
+  void finished(int index, QString path, QString cacheKey, quint64 contentHash);
+
+  void log(QString message);
+
+};
+
+#endif // UPLOADQUEUE_H
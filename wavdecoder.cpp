@@ -0,0 +1,186 @@
+#include "wavdecoder.h"
+#include <QtEndian>
+#include <string.h>
+
+WavDecoder::WavDecoder()
+{
+  m_format = SAMPLE_S16;
+  m_channels = 0;
+  m_sampleRate = 0;
+  m_blockAlign = 0;
+  m_dataLeft = 0;
+}
+
+/*
+ * walks the RIFF chunks up to "data", the format must come before it
+*/
+bool WavDecoder::open(QString path)
+{
+  char header[12];
+  bool hasFormat = false;
+
+  close();
+  m_file.setFileName(path);
+  if(!m_file.open(QIODevice::ReadOnly))
+    return fail(m_file.errorString());
+
+  if(m_file.read(header, sizeof(header)) != sizeof(header)
+     || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+    return fail(QString("Not a WAV file."));
+
+  for(;;)
+  {
+    char chunkHeader[8];
+    if(m_file.read(chunkHeader, sizeof(chunkHeader)) != sizeof(chunkHeader))
+      return fail(QString("WAV file without data."));
+
+    qint64 size = qFromLittleEndian<quint32>((const uchar*) chunkHeader + 4);
+
+    if(memcmp(chunkHeader, "fmt ", 4) == 0)
+    {
+      if(!readFormat(m_file.read(size)))
+        return false;
+      hasFormat = true;
+    }
+    else if(memcmp(chunkHeader, "data", 4) == 0)
+    {
+      if(!hasFormat)
+        return fail(QString("WAV data before its format."));
+      // streamed files may leave the size unset, and others lie about it
+      m_dataLeft = qMin(size, m_file.size() - m_file.pos());
+      m_dataLeft -= m_dataLeft % m_blockAlign;
+      return true;
+    }
+    else
+    {
+      m_file.seek(m_file.pos() + size);
+    }
+
+    if(size & 1)
+      m_file.seek(m_file.pos() + 1); // chunks are word aligned
+  }
+}
+
+void WavDecoder::close()
+{
+  m_file.close();
+  m_dataLeft = 0;
+  m_error.clear();
+}
+
+int WavDecoder::channels() const
+{
+  return m_channels;
+}
+
+int WavDecoder::sampleRate() const
+{
+  return m_sampleRate;
+}
+
+qint64 WavDecoder::read(float* frames, qint64 maxFrames)
+{
+  qint64 length = qMin(maxFrames * m_blockAlign, m_dataLeft);
+  int samples;
+
+  if(length == 0)
+    return 0;
+
+  m_raw.resize(length);
+  if(m_file.read(m_raw.data(), length) != length)
+  {
+    m_error = m_file.errorString();
+    return -1;
+  }
+  m_dataLeft -= length;
+
+  samples = (length / m_blockAlign) * m_channels;
+  const uchar* raw = (const uchar*) m_raw.constData();
+
+  switch(m_format){
+    case SAMPLE_U8:
+      for(int i = 0; i < samples; i++)
+        frames[i] = (raw[i] - 128) * (1.0f / 128);
+      break;
+    case SAMPLE_S16:
+      for(int i = 0; i < samples; i++)
+        frames[i] = qFromLittleEndian<qint16>(raw + 2 * i) * (1.0f / 32768);
+      break;
+    case SAMPLE_S24:
+      for(int i = 0; i < samples; i++, raw += 3)
+        frames[i] = ((qint32) ((raw[0] << 8) | (raw[1] << 16) | ((quint32) raw[2] << 24)) >> 8) * (1.0f / 8388608);
+      break;
+    case SAMPLE_S32:
+      for(int i = 0; i < samples; i++)
+        frames[i] = qFromLittleEndian<qint32>(raw + 4 * i) * (1.0f / 2147483648.0f);
+      break;
+    case SAMPLE_FLOAT32:
+      for(int i = 0; i < samples; i++)
+      {
+        quint32 bits = qFromLittleEndian<quint32>(raw + 4 * i);
+        memcpy(frames + i, &bits, sizeof(float));
+      }
+      break;
+    case SAMPLE_FLOAT64:
+      for(int i = 0; i < samples; i++)
+      {
+        quint64 bits = qFromLittleEndian<quint64>(raw + 8 * i);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        frames[i] = (float) value;
+      }
+      break;
+  }
+
+  return length / m_blockAlign;
+}
+
+QString WavDecoder::errorString() const
+{
+  return m_error;
+}
+
+bool WavDecoder::readFormat(const QByteArray& chunk)
+{
+  const uchar* data = (const uchar*) chunk.constData();
+
+  if(chunk.size() < 16)
+    return fail(QString("WAV format too short."));
+
+  quint16 tag = qFromLittleEndian<quint16>(data);
+  m_channels = qFromLittleEndian<quint16>(data + 2);
+  m_sampleRate = qFromLittleEndian<quint32>(data + 4);
+  m_blockAlign = qFromLittleEndian<quint16>(data + 12);
+  int bits = qFromLittleEndian<quint16>(data + 14);
+
+  // the real format tag is the start of the sub format GUID
+  if(tag == FORMAT_EXTENSIBLE && chunk.size() >= 26)
+    tag = qFromLittleEndian<quint16>(data + 24);
+
+  if(tag == FORMAT_PCM && bits == 8)
+    m_format = SAMPLE_U8;
+  else if(tag == FORMAT_PCM && bits == 16)
+    m_format = SAMPLE_S16;
+  else if(tag == FORMAT_PCM && bits == 24)
+    m_format = SAMPLE_S24;
+  else if(tag == FORMAT_PCM && bits == 32)
+    m_format = SAMPLE_S32;
+  else if(tag == FORMAT_FLOAT && bits == 32)
+    m_format = SAMPLE_FLOAT32;
+  else if(tag == FORMAT_FLOAT && bits == 64)
+    m_format = SAMPLE_FLOAT64;
+  else
+    return fail(QString("Unsupported WAV format %1, %2 bits.").arg(tag).arg(bits));
+
+  if(m_channels == 0 || m_sampleRate == 0 || m_blockAlign != m_channels * ((bits + 7) / 8))
+    return fail(QString("Invalid WAV format."));
+
+  return true;
+}
+
+bool WavDecoder::fail(QString error)
+{
+  m_file.close();
+  m_error = error;
+  return false;
+}
@@ -0,0 +1,62 @@
+#ifndef WAVDECODER_H
+#define WAVDECODER_H
+
+#include <QFile>
+#include <QByteArray>
+#include <QString>
+
+/*
+ * Reads the audio of a WAV file as interleaved float samples in [-1, 1].
+ * Integer PCM of 8 to 32 bits and float of 32 or 64 bits, plain or in
+ * WAVE_FORMAT_EXTENSIBLE. Compressed ones (ADPCM, ...) are left to QAudioDecoder.
+*/
+class WavDecoder
+{
+public:
+  WavDecoder();
+
+  // false if it is not a WAV file this can read, see errorString
+  bool open(QString path);
+
+  void close();
+
+  int channels() const;
+
+  int sampleRate() const;
+
+  // reads up to maxFrames frames into frames, which holds maxFrames * channels().
+  // returns the frames read, 0 at the end and -1 on a read error
+  qint64 read(float* frames, qint64 maxFrames);
+
+  QString errorString() const;
+
+private:
+  enum SampleFormat
+  {
+    SAMPLE_U8,
+    SAMPLE_S16,
+    SAMPLE_S24,
+    SAMPLE_S32,
+    SAMPLE_FLOAT32,
+    SAMPLE_FLOAT64,
+  };
+
+  static const quint16 FORMAT_PCM = 0x0001;
+  static const quint16 FORMAT_FLOAT = 0x0003;
+  static const quint16 FORMAT_EXTENSIBLE = 0xFFFE;
+
+  QFile m_file;
+  QByteArray m_raw; // the last block read, before conversion
+  SampleFormat m_format;
+  int m_channels;
+  int m_sampleRate;
+  int m_blockAlign; // bytes per frame
+  qint64 m_dataLeft; // bytes of the data chunk not read yet
+  QString m_error;
+
+  bool readFormat(const QByteArray& chunk);
+
+  bool fail(QString error);
+};
+
+#endif // WAVDECODER_H